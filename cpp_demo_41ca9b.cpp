@@ -10,6 +10,26 @@
 // // 2. **Audio Data Retrieval:** Accessing raw audio sample data.           //
 // // 3. **Basic Audio Processing:** Understanding amplitude and frequency.    //
 // // 4. **Graphics Rendering:** Drawing visual representations based on audio. //
+// // 5. **Streaming:** Handing samples from the audio thread to the drawing  //
+// //    thread through a lock-free ring buffer, for tracks of any length    //
+// //    and for live input from a microphone, with a clock of our own that   //
+// //    says which sample we hear right now.                                 //
+// // 6. **Spectrum Analysis:** A fast Fourier transform (FFT) of our own,     //
+// //    shown as bars from low to high frequencies.                           //
+// // 7. **Overview:** A zoomable view of the whole track, drawn from a        //
+// //    precomputed pyramid of peaks, cached on disk.                        //
+// // 8. **Sample Conversion:** Turning interleaved 16-bit samples into float  //
+// //    arrays per channel with SIMD, once per frame for every view.          //
+// // 9. **GPU Waveform:** Lines that live on the graphics card, moved by a    //
+// //    vertex shader that reads the samples from a texture.                 //
+// // 10. **Spectrogram:** Minutes of spectra in a circular texture, of which  //
+// //    each frame uploads only the newest column.                          //
+// // 11. **Batch Analysis:** Analyzing many files at once on a pool of       //
+// //    threads, with no window, for the viewer to load later.              //
+// // 12. **Pipeline:** Analysis on a thread of its own, handing its results  //
+// //    to the window through a lock-free triple buffer.                     //
+// // 13. **Profiling:** Timing every stage of a frame, shown on top of the   //
+// //    picture, and a benchmark of the kernels that writes JSON.            //
 // //                                                                          //
 // // We will focus on visualizing the *amplitude* (loudness) of the audio     //
 // // at different points in time to create a simple waveform.                  //
@@ -25,132 +45,2226 @@
 #include <SFML/Audio.hpp>
 #include <vector>
 #include <cmath> // For std::abs and std::sin/cos if we wanted frequency later
+#include <atomic>  // For the positions of the lock-free ring buffer
+#include <cstring> // For std::memcpy
+#include <string>  // For the command line arguments
+#include <algorithm> // For std::min
+#include <cstdint>   // For std::uint32_t
+#include <mutex>     // For std::mutex, which guards the peak pyramid
+#include <thread>    // For std::thread, which builds the peak pyramid
+#include <fstream>   // For reading and writing the peak cache
+#include <memory>    // For std::unique_ptr
+#include <filesystem> // For the size and time of the audio file, to check the cache
+#include <chrono>    // For std::chrono::steady_clock, which the playback clock runs on
+#include <cstdlib>   // For std::strtof
+#include <functional> // For std::function, the tasks of the batch analysis
+#include <deque>     // For the queue of those tasks
+#include <condition_variable> // For waking the threads that run them
+#include <iostream>  // For the report of the batch analysis
+#include "frame_profiler.hpp" // For the profiling overlay (F3), shared with the Mandelbrot viewer
+
+// The FFT and the sample conversion compute four floats at once with SSE2 (x86) or
+// NEON (ARM) instructions.
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define VISUALIZER_SSE 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define VISUALIZER_NEON 1
+#endif
 
 // Define some constants for our window and visualization
 const unsigned int WINDOW_WIDTH = 800;
 const unsigned int WINDOW_HEIGHT = 600;
+const char* const WINDOW_TITLE = "SFML Audio Visualizer";
 const int MAX_SAMPLES_TO_DISPLAY = 500; // How many audio samples we'll process at once
 const float AMPLITUDE_SCALE = 50.0f;  // How much to stretch the waveform vertically
 
-int main() {
+// Constants for streaming the audio
+const std::size_t CHUNK_SAMPLES = 4096;    // Samples per chunk (all channels together)
+const std::size_t RING_CHUNKS = 64;        // Chunks the ring buffer holds (about 3 s of stereo)
+const std::size_t HISTORY_FRAMES = 1 << 16; // Frames the drawing side keeps (about 1.5 s)
+const unsigned int MIC_SAMPLE_RATE = 44100;
+
+// //////////////////////////////////////////////////////////////////////////////
+// // Streaming the audio                                                      //
+// //////////////////////////////////////////////////////////////////////////////
+//
+// sf::Music plays a file by streaming it: it decodes a small piece at a time on a
+// thread of its own and never holds the whole track, so there is no array of all
+// the samples to look at. Instead we stream the file ourselves, with an
+// sf::SoundStream: SFML calls our onGetData() on its audio thread whenever it needs
+// the next chunk of samples. We read that chunk from the file, give it to SFML to
+// play, and also put a copy in a ring buffer for the window to draw. Live input
+// works the same way, with an sf::SoundRecorder whose onProcessSamples() gets every
+// chunk the microphone (or line-in) records.
+//
+// The audio thread must never wait for the drawing: if it is late, we hear a gap.
+// So the ring buffer is "lock-free": the two threads share it without a mutex. It
+// only works with one thread writing (the "producer", the audio thread) and one
+// thread reading (the "consumer", the window): single-producer, single-consumer or
+// "SPSC". Each thread owns one counter: the producer counts the chunks it has
+// written ('head_'), the consumer the ones it has read ('tail_'). The slots between
+// tail and head are full; all others are free. A thread only ever changes its own
+// counter, and only after it has finished with the slot, so each thread can see from
+// the other's counter which slots it may touch. The "release" store and "acquire"
+// load make sure the slot's contents arrive before the counter that announces them.
+// If the window falls behind and the ring is full, the producer simply drops the
+// copy of that chunk (the audio still plays); it never waits.
+//
+// Memory stays bounded however long the track is: the ring holds RING_CHUNKS chunks,
+// and the window keeps only the last HISTORY_FRAMES frames it took out of it.
+
+// One chunk of interleaved samples, and where in the stream it starts. A "frame" is
+// one sample of every channel, so a stereo frame is two samples.
+struct AudioChunk {
+    sf::Uint64 first_frame = 0;   // The index of its first frame in the whole stream
+    std::size_t sample_count = 0; // How many of 'samples' are used
+    sf::Int16 samples[CHUNK_SAMPLES];
+};
+
+// The lock-free SPSC ring buffer. The producer fills the slot begin_push() returns
+// and then calls end_push(); the consumer reads the slot front() returns and then
+// calls pop(). Neither ever blocks.
+template <typename T>
+class SpscRing {
+public:
+    explicit SpscRing(std::size_t capacity) : slots_(capacity) {}
+
+    // Producer: the next free slot, or nullptr if the ring is full.
+    T* begin_push() {
+        sf::Uint64 head = head_.load(std::memory_order_relaxed);
+        if (head - tail_.load(std::memory_order_acquire) == slots_.size()) return nullptr;
+        return &slots_[head % slots_.size()];
+    }
+    // Producer: hands the slot from begin_push() to the consumer.
+    void end_push() { head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+    // Consumer: the oldest full slot, or nullptr if the ring is empty.
+    const T* front() const {
+        sf::Uint64 tail = tail_.load(std::memory_order_relaxed);
+        if (tail == head_.load(std::memory_order_acquire)) return nullptr;
+        return &slots_[tail % slots_.size()];
+    }
+    // Consumer: gives the slot from front() back to the producer.
+    void pop() { tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+private:
+    std::vector<T> slots_;
+    // Each counter on its own cache line, so the two threads don't slow each other down
+    // by writing to the same line ("false sharing").
+    alignas(64) std::atomic<sf::Uint64> head_{0};
+    alignas(64) std::atomic<sf::Uint64> tail_{0};
+};
+
+// //////////////////////////////////////////////////////////////////////////////
+// // The playback clock                                                       //
+// //////////////////////////////////////////////////////////////////////////////
+//
+// To draw what we hear, the window needs to know which frame is playing right now.
+// sf::SoundStream::getPlayingOffset() only moves when SFML notices that a whole
+// buffer has finished (it checks every 10 ms or so), so it jumps in steps, and the
+// waveform jitters and lags. Instead we keep a clock of our own.
+//
+// SFML keeps STREAM_BUFFERS chunks queued for the sound card. When it asks for the
+// next one, the oldest has just finished playing, so the chunk we gave it
+// (STREAM_BUFFERS - 1) requests ago starts playing now. At that moment the audio
+// thread notes down the "anchor": that chunk's first frame, and the time on
+// std::chrono::steady_clock. In between, the analysis thread (see "The pipeline")
+// extrapolates: the anchor's frame plus the time since then, times the sample rate.
+// The requests themselves arrive a few milliseconds late now and then, so each new
+// anchor is only taken a tenth of the way from where the extrapolation says we are
+// (a small filter that also follows if the sound card's clock runs a little fast or
+// slow), unless it is more than a chunk away (a seek, or the end of a pause); then
+// it is taken as it is.
+//
+// Then there is the output latency: after the sound card takes a sample, it still
+// takes some milliseconds until we hear it. We subtract it, OUTPUT_LATENCY seconds
+// by default (SFML has no way to ask the device), or what --latency says.
+//
+// The anchor is two numbers, written by the audio thread and read by the analysis
+// thread, which must never see one new and one old number. A "sequence lock" does
+// it without a mutex: the writer makes the counter odd before it writes and even
+// again afterwards, and the reader tries again if the counter was odd or changed
+// while it read.
+const int STREAM_BUFFERS = 3;              // How many chunks SFML queues (its BufferCount)
+const float OUTPUT_LATENCY = 0.03f;        // Seconds from the sound card to our ears
+const double CLOCK_CORRECTION = 0.1;       // How far a new anchor moves the clock
+
+class PlaybackClock {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Before playback starts: the sample rate, and the latency in seconds.
+    void configure(unsigned int sample_rate, float latency) {
+        sample_rate_ = sample_rate;
+        latency_ = latency;
+        restart(0);
+    }
+
+    // Audio side: playback starts over at 'frame' (at the start, or after a seek).
+    void restart(sf::Uint64 frame) {
+        requests_ = 0;
+        publish(static_cast<double>(frame), now());
+    }
+
+    // Audio side: SFML asked for the chunk that starts at 'first_frame'.
+    void requested(sf::Uint64 first_frame, sf::Uint64 chunk_frames) {
+        queued_[requests_ % STREAM_BUFFERS] = first_frame;
+        sf::Int64 time = now();
+        if (requests_ == 0) {
+            publish(static_cast<double>(first_frame), time); // The first chunk starts right away
+        } else if (requests_ >= STREAM_BUFFERS) {
+            // The chunk from STREAM_BUFFERS - 1 requests ago starts now.
+            double playing = static_cast<double>(queued_[(requests_ + 1) % STREAM_BUFFERS]);
+            double expected = frame_.load(std::memory_order_relaxed) +
+                              (time - time_.load(std::memory_order_relaxed)) * 1e-9 * sample_rate_;
+            double error = playing - expected;
+            publish(std::abs(error) > chunk_frames ? playing : expected + error * CLOCK_CORRECTION, time);
+        }
+        ++requests_;
+    }
+
+    // Reader side (the analysis thread): the frame we hear now. While 'playing' is false (paused), the clock
+    // stands still.
+    double frame(bool playing) {
+        sf::Int64 time = now();
+        if (!playing && !paused_) pause_start_ = time;
+        if (playing && paused_) pause_end_ = time;
+        paused_ = !playing;
+
+        double anchor_frame;
+        sf::Int64 anchor_time;
+        read(anchor_frame, anchor_time);
+        // Minus the part of the last pause that came after the anchor
+        sf::Int64 pause_end = paused_ ? time : pause_end_;
+        sf::Int64 paused = std::max<sf::Int64>(0, pause_end - std::max(anchor_time, pause_start_));
+        double elapsed = (time - anchor_time - paused) * 1e-9;
+        return std::max(0.0, anchor_frame + (elapsed - latency_) * sample_rate_);
+    }
+
+private:
+    static sf::Int64 now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+    }
+
+    void publish(double frame, sf::Int64 time) {
+        unsigned int sequence = sequence_.load(std::memory_order_relaxed);
+        sequence_.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        frame_.store(frame, std::memory_order_relaxed);
+        time_.store(time, std::memory_order_relaxed);
+        sequence_.store(sequence + 2, std::memory_order_release);
+    }
+
+    void read(double& frame, sf::Int64& time) const {
+        for (;;) {
+            unsigned int before = sequence_.load(std::memory_order_acquire);
+            frame = frame_.load(std::memory_order_relaxed);
+            time = time_.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (before % 2 == 0 && sequence_.load(std::memory_order_relaxed) == before) return;
+        }
+    }
+
+    unsigned int sample_rate_ = 44100;
+    float latency_ = OUTPUT_LATENCY;
+
+    // The anchor, behind the sequence lock.
+    std::atomic<unsigned int> sequence_{0};
+    std::atomic<double> frame_{0.0};
+    std::atomic<sf::Int64> time_{0};
+
+    // Audio side only
+    sf::Uint64 queued_[STREAM_BUFFERS] = {};  // The first frames of the last chunks requested
+    sf::Uint64 requests_ = 0;                 // Since the last restart
+
+    // Reader side only
+    bool paused_ = false;
+    sf::Int64 pause_start_ = 0, pause_end_ = 0; // The last pause
+};
+
+// Plays an audio file by streaming it from disk, and passes every chunk on to the ring.
+class FileStream : public sf::SoundStream {
+public:
+    explicit FileStream(SpscRing<AudioChunk>& ring) : ring_(ring) {}
+    // The audio thread must stop before our members go away (SFML's own destructor
+    // would stop it too, but only after they're gone).
+    ~FileStream() override { stop(); }
+
+    bool open(const std::string& path) {
+        if (!file_.openFromFile(path)) return false;
+        initialize(file_.getChannelCount(), file_.getSampleRate());
+        clock_.configure(file_.getSampleRate(), OUTPUT_LATENCY);
+        return true;
+    }
+
+    // The length of the file, in frames.
+    sf::Uint64 frame_count() const { return file_.getSampleCount() / file_.getChannelCount(); }
+
+    // How many chunks the window didn't take in time (they were played, not drawn).
+    sf::Uint64 dropped_chunks() const { return dropped_.load(std::memory_order_relaxed); }
+
+    // The clock that says which frame we hear (see PlaybackClock).
+    PlaybackClock& clock() { return clock_; }
+
+private:
+    // Called by SFML on its audio thread: the next chunk to play.
+    bool onGetData(Chunk& data) override {
+        // Read whole frames only, so every chunk starts with channel 0.
+        std::size_t channels = file_.getChannelCount();
+        std::size_t count = static_cast<std::size_t>(file_.read(buffer_, CHUNK_SAMPLES / channels * channels));
+        if (count == 0) return false; // The end of the file: stop playing
+
+        if (AudioChunk* chunk = ring_.begin_push()) {
+            chunk->first_frame = next_frame_;
+            chunk->sample_count = count;
+            std::memcpy(chunk->samples, buffer_, count * sizeof(sf::Int16));
+            ring_.end_push();
+        } else {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+        }
+        clock_.requested(next_frame_, count / channels);
+        next_frame_ += count / channels;
+
+        data.samples = buffer_;
+        data.sampleCount = count;
+        return true;
+    }
+
+    // Called by SFML when playback jumps (for example back to the start after stop()).
+    void onSeek(sf::Time timeOffset) override {
+        file_.seek(timeOffset);
+        next_frame_ = file_.getSampleOffset() / file_.getChannelCount();
+        clock_.restart(next_frame_);
+    }
+
+    SpscRing<AudioChunk>& ring_;
+    sf::InputSoundFile file_;
+    sf::Int16 buffer_[CHUNK_SAMPLES];  // The chunk SFML plays (ours until the next call)
+    sf::Uint64 next_frame_ = 0;        // The frame the next chunk starts with
+    std::atomic<sf::Uint64> dropped_{0};
+    PlaybackClock clock_;
+};
+
+// Records from the default input device (microphone or line-in) into the ring.
+class MicrophoneInput : public sf::SoundRecorder {
+public:
+    explicit MicrophoneInput(SpscRing<AudioChunk>& ring) : ring_(ring) {}
+    ~MicrophoneInput() override { stop(); } // As for FileStream
+
+private:
+    // Called by SFML on its recording thread with every piece it has recorded.
+    bool onProcessSamples(const sf::Int16* samples, std::size_t sampleCount) override {
+        while (sampleCount > 0) {
+            std::size_t count = std::min(sampleCount, CHUNK_SAMPLES);
+            if (AudioChunk* chunk = ring_.begin_push()) {
+                chunk->first_frame = next_frame_;
+                chunk->sample_count = count;
+                std::memcpy(chunk->samples, samples, count * sizeof(sf::Int16));
+                ring_.end_push();
+            }
+            next_frame_ += count; // Recording is mono: a sample is a frame
+            samples += count;
+            sampleCount -= count;
+        }
+        return true; // Keep recording
+    }
+
+    SpscRing<AudioChunk>& ring_;
+    sf::Uint64 next_frame_ = 0;
+};
+
+// //////////////////////////////////////////////////////////////////////////////
+// // Converting samples                                                       //
+// //////////////////////////////////////////////////////////////////////////////
+//
+// Audio arrives "interleaved" and as 16-bit integers: left, right, left, right, ...
+// Everything we compute with wants floats from -1 to 1, one array per channel
+// ("planar"), so the FFT can read a channel as one contiguous array. That conversion
+// happens in one place, convert_frames(), a whole block at a time: the history turns
+// the frames a video frame needs into a PlanarBuffer once, and the waveform, the
+// spectrum and the peak pyramid all read from it.
+//
+// For mono and stereo (nearly all audio) convert_frames() uses SSE2 (or NEON): it
+// loads 8 samples at once, widens them to 32-bit integers, converts those to floats,
+// sorts them into the channels with a shuffle, and multiplies by the scale, which
+// combines the normalization (1 / 32768) with a gain. The mix of all channels, for
+// the waveform, comes out of the same pass. Other channel counts take a plain loop.
+
+// Converts 'frames' interleaved frames of 'channels' samples each into 'planes' (one
+// array per channel), from index 'offset' on, each sample times 'scale'. Unless 'mix'
+// is nullptr, the average of the channels goes there too.
+void convert_frames(const sf::Int16* in, std::size_t frames, unsigned int channels, float scale,
+                    float* const* planes, float* mix, std::size_t offset) {
+    std::size_t i = 0;
+#if defined(VISUALIZER_SSE)
+    const __m128 factor = _mm_set1_ps(scale);
+    // Unpacking a sample next to itself and shifting right by 16 widens it, sign and all.
+    auto low_floats = [](__m128i s) { return _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16)); };
+    auto high_floats = [](__m128i s) { return _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16)); };
+    if (channels == 1) {
+        for (; i + 8 <= frames; i += 8) {
+            __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+            __m128 a = _mm_mul_ps(low_floats(s), factor), b = _mm_mul_ps(high_floats(s), factor);
+            _mm_storeu_ps(planes[0] + offset + i, a);
+            _mm_storeu_ps(planes[0] + offset + i + 4, b);
+            if (mix != nullptr) {
+                _mm_storeu_ps(mix + offset + i, a);
+                _mm_storeu_ps(mix + offset + i + 4, b);
+            }
+        }
+    } else if (channels == 2) {
+        const __m128 half = _mm_set1_ps(0.5f);
+        for (; i + 4 <= frames; i += 4) {
+            __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 2 * i));
+            __m128 a = low_floats(s), b = high_floats(s); // L0 R0 L1 R1 and L2 R2 L3 R3
+            __m128 left = _mm_mul_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)), factor);
+            __m128 right = _mm_mul_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)), factor);
+            _mm_storeu_ps(planes[0] + offset + i, left);
+            _mm_storeu_ps(planes[1] + offset + i, right);
+            if (mix != nullptr) _mm_storeu_ps(mix + offset + i, _mm_mul_ps(_mm_add_ps(left, right), half));
+        }
+    }
+#elif defined(VISUALIZER_NEON)
+    const float32x4_t factor = vdupq_n_f32(scale);
+    if (channels == 1) {
+        for (; i + 8 <= frames; i += 8) {
+            int16x8_t s = vld1q_s16(in + i);
+            float32x4_t a = vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(s))), factor);
+            float32x4_t b = vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(s))), factor);
+            vst1q_f32(planes[0] + offset + i, a);
+            vst1q_f32(planes[0] + offset + i + 4, b);
+            if (mix != nullptr) {
+                vst1q_f32(mix + offset + i, a);
+                vst1q_f32(mix + offset + i + 4, b);
+            }
+        }
+    } else if (channels == 2) {
+        for (; i + 4 <= frames; i += 4) {
+            int16x4x2_t s = vld2_s16(in + 2 * i); // Loads and separates the channels in one go
+            float32x4_t left = vmulq_f32(vcvtq_f32_s32(vmovl_s16(s.val[0])), factor);
+            float32x4_t right = vmulq_f32(vcvtq_f32_s32(vmovl_s16(s.val[1])), factor);
+            vst1q_f32(planes[0] + offset + i, left);
+            vst1q_f32(planes[1] + offset + i, right);
+            if (mix != nullptr) vst1q_f32(mix + offset + i, vmulq_f32(vaddq_f32(left, right), vdupq_n_f32(0.5f)));
+        }
+    }
+#endif
+    const float average = 1.0f / channels;
+    for (; i < frames; ++i) { // The rest (and other channel counts)
+        float sum = 0.0f;
+        for (unsigned int c = 0; c < channels; ++c) {
+            float value = in[i * channels + c] * scale;
+            planes[c][offset + i] = value;
+            sum += value;
+        }
+        if (mix != nullptr) mix[offset + i] = sum * average;
+    }
+}
+
+// A block of frames as floats: an array per channel, and one for their mix.
+class PlanarBuffer {
+public:
+    PlanarBuffer(unsigned int channels, std::size_t capacity)
+        : capacity_(capacity), data_((channels + 1) * capacity), planes_(channels) {
+        for (unsigned int c = 0; c < channels; ++c) planes_[c] = &data_[c * capacity];
+    }
+
+    std::size_t capacity() const { return capacity_; }
+    const float* channel(unsigned int c) const { return planes_[c]; }
+    const float* mix() const { return &data_[planes_.size() * capacity_]; }
+    const float* const* planes() const { return planes_.data(); }
+
+    // Converts 'frames' interleaved frames into frames 'offset' on, times 'scale'.
+    void convert(const sf::Int16* in, std::size_t frames, float scale, std::size_t offset = 0) {
+        convert_frames(in, frames, static_cast<unsigned int>(planes_.size()), scale, planes_.data(),
+                       &data_[planes_.size() * capacity_], offset);
+    }
+
+    // Makes frames 'from' up to 'to' silent.
+    void silence(std::size_t from, std::size_t to) {
+        for (std::size_t c = 0; c <= planes_.size(); ++c) {
+            std::fill(&data_[c * capacity_ + from], &data_[c * capacity_ + to], 0.0f);
+        }
+    }
+
+private:
+    std::size_t capacity_;
+    std::vector<float> data_;   // The channels, then the mix
+    std::vector<float*> planes_;
+};
+
+// The window's side: the newest HISTORY_FRAMES frames taken out of the ring, in a
+// circular buffer of its own, so we can look back from the newest sample to the one
+// being heard right now.
+class SampleHistory {
+public:
+    explicit SampleHistory(unsigned int channels)
+        : channels_(channels), samples_(HISTORY_FRAMES * channels) {}
+
+    // Converts the 'count' frames from 'first' on into 'out', times 'gain', with silence
+    // for the frames we don't have (not yet decoded, too long ago, or before the start:
+    // 'first' may be negative).
+    void read(sf::Int64 first, std::size_t count, float gain, PlanarBuffer& out) const {
+        const sf::Int64 last = first + static_cast<sf::Int64>(count);
+        sf::Int64 from = std::min(std::max(first, static_cast<sf::Int64>(end_frame_ - frames_)), last);
+        sf::Int64 to = std::max(from, std::min(last, static_cast<sf::Int64>(end_frame_)));
+        out.silence(0, static_cast<std::size_t>(from - first));
+        out.silence(static_cast<std::size_t>(to - first), count);
+        while (from < to) { // In at most two pieces, as the buffer is circular
+            std::size_t slot = static_cast<std::size_t>(from % HISTORY_FRAMES);
+            std::size_t pieceFrames = static_cast<std::size_t>(std::min<sf::Uint64>(to - from, HISTORY_FRAMES - slot));
+            out.convert(&samples_[slot * channels_], pieceFrames, gain / 32768.0f, static_cast<std::size_t>(from - first));
+            from += pieceFrames;
+        }
+    }
+
+    // One past the newest frame we have, and the oldest one.
+    sf::Uint64 end_frame() const { return end_frame_; }
+    sf::Uint64 first_frame() const { return end_frame_ - frames_; }
+
+    // The circular buffer itself: frame f is at (f % HISTORY_FRAMES) * channels.
+    const sf::Int16* samples() const { return samples_.data(); }
+
+    // Adds a chunk from the ring buffer.
+    void append(const AudioChunk& chunk) {
+        if (chunk.first_frame != end_frame_) frames_ = 0; // A jump: the old frames don't lead here
+        std::size_t count = chunk.sample_count / channels_;
+        for (std::size_t i = 0; i < count; ++i) {
+            sf::Uint64 index = chunk.first_frame + i;
+            std::memcpy(&samples_[(index % HISTORY_FRAMES) * channels_], &chunk.samples[i * channels_],
+                        channels_ * sizeof(sf::Int16));
+        }
+        end_frame_ = chunk.first_frame + count;
+        frames_ = std::min<sf::Uint64>(frames_ + count, HISTORY_FRAMES);
+    }
+
+private:
+    unsigned int channels_;
+    std::vector<sf::Int16> samples_;
+    sf::Uint64 end_frame_ = 0; // One past the newest frame...
+    sf::Uint64 frames_ = 0;    // ...and how many frames before it we have
+};
+
+// //////////////////////////////////////////////////////////////////////////////
+// // The waveform on the GPU                                                  //
+// //////////////////////////////////////////////////////////////////////////////
+//
+// The plain waveform below builds all its vertices on the CPU again every frame, and
+// sends them to the graphics card again: fine for MAX_SAMPLES_TO_DISPLAY samples, but
+// not for tens of thousands per channel. The GPU can do that work instead:
+//
+// - The lines themselves never change, only how long they are. So they live in an
+//   sf::VertexBuffer on the graphics card, created once: per channel and frame, a
+//   line from the center of the channel's band (green) to a tip (cyan). Each vertex
+//   knows which frame and channel it is (in its texture coordinates), and whether it
+//   is a tip.
+// - The samples go into a texture, the same circular buffer as the SampleHistory:
+//   its bytes, as they are, two 16-bit samples per RGBA pixel, 2048 samples per row.
+//   Each frame we upload only the rows the new chunks touched, a few kilobytes.
+// - A "vertex shader", a program the GPU runs for every vertex, looks up the vertex's
+//   sample in the texture and moves the tip up or down by it. Uniforms (values we set
+//   per draw) say where in the circular buffer the view starts, which frames we have
+//   (the others stay flat), and the scale.
+//
+// So a frame costs the CPU a small upload and a few uniforms, however many samples
+// are drawn. (The bytes go as they are, so this assumes a little-endian CPU, which
+// is what SFML runs on: the low byte of each sample comes first.)
+const int GPU_WAVEFORM_FRAMES = 16384;    // Frames per channel the GPU draws (about 0.4 s)
+const unsigned int WAVEFORM_TEXTURE_WIDTH = 1024; // Pixels per row, as in the shader
+
+const char* const WAVEFORM_VERTEX_SHADER = R"(
+#version 120
+uniform sampler2D samples;  // The history's samples, two per pixel
+uniform float rows;         // The height of that texture
+uniform float history;      // HISTORY_FRAMES
+uniform float channels;
+uniform float first_slot;   // Where the frame at the left edge is in the history
+uniform vec2 shown;         // The frames we have, from and to (left edge = 0)
+uniform float scale;        // Pixels per unit of amplitude
+
+const float WIDTH = 1024.0; // WAVEFORM_TEXTURE_WIDTH
+
+void main() {
+    float frame = gl_MultiTexCoord0.x;
+    float channel = floor(gl_MultiTexCoord0.y / 2.0);
+    float tip = gl_MultiTexCoord0.y - channel * 2.0; // 0 for the center end, 1 for the tip
+
+    // Find the sample: its index in the history, the pixel, and the half of the pixel.
+    float index = mod(first_slot + frame, history) * channels + channel;
+    float pixel = floor(index / 2.0);
+    vec2 position = (vec2(mod(pixel, WIDTH), floor(pixel / WIDTH)) + 0.5) / vec2(WIDTH, rows);
+    vec4 bytes = floor(texture2DLod(samples, position, 0.0) * 255.0 + 0.5);
+    vec2 halves = index - pixel * 2.0 < 0.5 ? bytes.rg : bytes.ba;
+    float value = halves.x + halves.y * 256.0;
+    if (value >= 32768.0) value -= 65536.0; // The sign
+
+    float visible = step(shown.x, frame) * (1.0 - step(shown.y, frame));
+    vec4 vertex = gl_Vertex;
+    vertex.y -= value / 32768.0 * scale * tip * visible;
+    gl_Position = gl_ModelViewProjectionMatrix * vertex;
+    gl_FrontColor = gl_Color;
+}
+)";
+
+const char* const WAVEFORM_FRAGMENT_SHADER = R"(
+void main() {
+    gl_FragColor = gl_Color;
+}
+)";
+
+class GpuWaveform {
+public:
+    explicit GpuWaveform(unsigned int channels) : channels_(channels), vertices_(sf::Lines, sf::VertexBuffer::Static) {}
+
+    // Compiles the shader and creates the vertex buffer and the texture. Returns false
+    // (and the CPU draws the waveform) if the graphics card can't do it.
+    bool create() {
+        if (!sf::Shader::isAvailable() || !sf::VertexBuffer::isAvailable()) return false;
+        if (!shader_.loadFromMemory(WAVEFORM_VERTEX_SHADER, WAVEFORM_FRAGMENT_SHADER)) return false;
+        rows_ = static_cast<unsigned int>(HISTORY_FRAMES * channels_ / (WAVEFORM_TEXTURE_WIDTH * 2));
+        if (!samples_.create(WAVEFORM_TEXTURE_WIDTH, rows_)) return false;
+
+        // The lines, once and for all
+        std::vector<sf::Vertex> lines(static_cast<std::size_t>(channels_) * GPU_WAVEFORM_FRAMES * 2);
+        float bandHeight = static_cast<float>(WINDOW_HEIGHT) / channels_;
+        for (unsigned int channel = 0; channel < channels_; ++channel) {
+            float center = bandHeight * (channel + 0.5f);
+            for (int i = 0; i < GPU_WAVEFORM_FRAMES; ++i) {
+                float x = static_cast<float>(i) * WINDOW_WIDTH / GPU_WAVEFORM_FRAMES;
+                float frame = static_cast<float>(i), code = static_cast<float>(channel * 2);
+                sf::Vertex* line = &lines[(static_cast<std::size_t>(channel) * GPU_WAVEFORM_FRAMES + i) * 2];
+                line[0] = sf::Vertex(sf::Vector2f(x, center), sf::Color::Green, sf::Vector2f(frame, code));
+                line[1] = sf::Vertex(sf::Vector2f(x, center), sf::Color::Cyan, sf::Vector2f(frame, code + 1.0f));
+            }
+        }
+        if (!vertices_.create(lines.size()) || !vertices_.update(lines.data())) return false;
+
+        shader_.setUniform("samples", samples_);
+        shader_.setUniform("rows", static_cast<float>(rows_));
+        shader_.setUniform("history", static_cast<float>(HISTORY_FRAMES));
+        shader_.setUniform("channels", static_cast<float>(channels_));
+        return true;
+    }
+
+    // Uploads what 'history' got since the last call, in whole rows of the texture.
+    void upload(const SampleHistory& history) {
+        sf::Uint64 from = std::max(uploaded_end_, history.first_frame());
+        if (uploaded_end_ > history.end_frame()) from = history.first_frame(); // A jump back
+        sf::Uint64 to = history.end_frame();
+        uploaded_end_ = to;
+        if (from >= to) return;
+
+        const std::size_t rowSamples = WAVEFORM_TEXTURE_WIDTH * 2;
+        std::size_t firstSample = static_cast<std::size_t>(from % HISTORY_FRAMES) * channels_;
+        std::size_t sampleCount = static_cast<std::size_t>(to - from) * channels_;
+        std::size_t firstRow = firstSample / rowSamples, lastRow = (firstSample + sampleCount - 1) / rowSamples;
+        const sf::Uint8* bytes = reinterpret_cast<const sf::Uint8*>(history.samples());
+        for (std::size_t row = firstRow; row <= lastRow; ++row) {
+            unsigned int y = static_cast<unsigned int>(row % rows_); // The buffer may wrap around
+            samples_.update(bytes + static_cast<std::size_t>(y) * rowSamples * sizeof(sf::Int16),
+                            WAVEFORM_TEXTURE_WIDTH, 1, 0, y);
+        }
+    }
+
+    // Draws the GPU_WAVEFORM_FRAMES frames from 'first' on, of those 'history' has.
+    void draw(sf::RenderTarget& target, sf::Int64 first, const SampleHistory& history, float gain) {
+        sf::Int64 slot = first % static_cast<sf::Int64>(HISTORY_FRAMES);
+        if (slot < 0) slot += HISTORY_FRAMES;
+        float from = static_cast<float>(static_cast<sf::Int64>(history.first_frame()) - first);
+        float to = static_cast<float>(static_cast<sf::Int64>(history.end_frame()) - first);
+        shader_.setUniform("first_slot", static_cast<float>(slot));
+        shader_.setUniform("shown", sf::Glsl::Vec2(from, to));
+        shader_.setUniform("scale", AMPLITUDE_SCALE * gain);
+        target.draw(vertices_, &shader_);
+    }
+
+private:
+    unsigned int channels_;
+    unsigned int rows_ = 0;
+    sf::Shader shader_;
+    sf::VertexBuffer vertices_;   // The lines, on the graphics card
+    sf::Texture samples_;         // The history's samples, on the graphics card
+    sf::Uint64 uploaded_end_ = 0; // One past the newest frame in the texture
+};
+
+// //////////////////////////////////////////////////////////////////////////////
+// // The spectrum                                                             //
+// //////////////////////////////////////////////////////////////////////////////
+//
+// The waveform shows loudness over time; the spectrum shows which *frequencies* the
+// sound is made of right now. The Fourier transform turns FFT_SIZE samples into the
+// strength of FFT_SIZE / 2 + 1 evenly spaced frequencies ("bins"), from 0 Hz up to
+// half the sample rate; bin k is the frequency k * sampleRate / FFT_SIZE. Computed
+// directly that costs FFT_SIZE^2 multiplications; the Fast Fourier Transform (FFT)
+// gets the same result with about FFT_SIZE * log2(FFT_SIZE).
+//
+// How our FFT works:
+// - Radix 2: a transform of n points is made from two transforms of n / 2 points (the
+//   even and the odd samples) with one "butterfly" per pair: a + w*b and a - w*b,
+//   where the "twiddle factor" w is a point on the unit circle. Applied all the way
+//   down, that is log2(n) passes ("stages") over the data. Starting the data in
+//   "bit-reversed" order lets every stage work in place.
+// - The real and imaginary parts are kept in separate arrays, so four neighboring
+//   butterflies are four neighboring floats, and SSE (or NEON) instructions compute
+//   them together.
+// - Audio samples are real numbers, and a complex FFT would waste half its work on
+//   imaginary parts that are all zero. So we pack the even samples into the real
+//   parts and the odd samples into the imaginary parts, do a complex FFT of half the
+//   size, and untangle the two halves afterwards with one more twiddle per bin.
+// - Every twiddle factor, the window and the bit-reversed order are computed once,
+//   in the constructor, and all buffers are allocated there too: analyzing a frame
+//   allocates nothing.
+//
+// Cutting a block out of the sound makes its ends jump, and those jumps would show up
+// as noise across all frequencies. So the block is first multiplied by a Hann window,
+// which fades it in and out smoothly.
+//
+// The bins are evenly spaced, but we hear pitch logarithmically: every octave (a
+// doubling of frequency) sounds like the same step. So the bars are log-spaced, each
+// BAR_COUNT-th of the way from MIN_FREQUENCY to the highest frequency, and show the
+// strongest bin in their range, in decibels.
+const std::size_t FFT_SIZE = 4096;       // Samples per transform (a power of two)
+const int BAR_COUNT = 64;                // Bars in the spectrum
+const float MIN_FREQUENCY = 30.0f;       // The lowest bar starts here (Hz)
+const float DB_RANGE = 80.0f;            // The bars show 0 dB down to -DB_RANGE dB
+const float BAR_FALL_PER_FRAME = 0.01f;  // Bars rise at once but fall this much per analysis
+
+// The butterflies a + w*b and a - w*b for 'count' neighboring pairs: a = (ar, ai),
+// b = (br, bi) and w = (wr, wi), each as separate arrays of real and imaginary parts.
+void butterflies(float* ar, float* ai, float* br, float* bi, const float* wr, const float* wi, std::size_t count) {
+    std::size_t j = 0;
+#if defined(VISUALIZER_SSE)
+    for (; j + 4 <= count; j += 4) {
+        __m128 xr = _mm_loadu_ps(br + j), xi = _mm_loadu_ps(bi + j);
+        __m128 cr = _mm_loadu_ps(wr + j), ci = _mm_loadu_ps(wi + j);
+        __m128 tr = _mm_sub_ps(_mm_mul_ps(xr, cr), _mm_mul_ps(xi, ci)); // t = w * b
+        __m128 ti = _mm_add_ps(_mm_mul_ps(xr, ci), _mm_mul_ps(xi, cr));
+        __m128 ur = _mm_loadu_ps(ar + j), ui = _mm_loadu_ps(ai + j);
+        _mm_storeu_ps(ar + j, _mm_add_ps(ur, tr));
+        _mm_storeu_ps(ai + j, _mm_add_ps(ui, ti));
+        _mm_storeu_ps(br + j, _mm_sub_ps(ur, tr));
+        _mm_storeu_ps(bi + j, _mm_sub_ps(ui, ti));
+    }
+#elif defined(VISUALIZER_NEON)
+    for (; j + 4 <= count; j += 4) {
+        float32x4_t xr = vld1q_f32(br + j), xi = vld1q_f32(bi + j);
+        float32x4_t cr = vld1q_f32(wr + j), ci = vld1q_f32(wi + j);
+        float32x4_t tr = vsubq_f32(vmulq_f32(xr, cr), vmulq_f32(xi, ci));
+        float32x4_t ti = vaddq_f32(vmulq_f32(xr, ci), vmulq_f32(xi, cr));
+        float32x4_t ur = vld1q_f32(ar + j), ui = vld1q_f32(ai + j);
+        vst1q_f32(ar + j, vaddq_f32(ur, tr));
+        vst1q_f32(ai + j, vaddq_f32(ui, ti));
+        vst1q_f32(br + j, vsubq_f32(ur, tr));
+        vst1q_f32(bi + j, vsubq_f32(ui, ti));
+    }
+#endif
+    for (; j < count; ++j) { // The rest (and everything without SIMD)
+        float tr = br[j] * wr[j] - bi[j] * wi[j];
+        float ti = br[j] * wi[j] + bi[j] * wr[j];
+        br[j] = ar[j] - tr;
+        bi[j] = ai[j] - ti;
+        ar[j] += tr;
+        ai[j] += ti;
+    }
+}
+
+// The FFT of real samples, with everything it needs computed in advance.
+class RealFft {
+public:
+    explicit RealFft(std::size_t size) // A power of two, at least 16
+        : size_(size), half_(size / 2), window_(size), bit_reverse_(half_), twiddle_re_(half_),
+          twiddle_im_(half_), split_re_(half_ + 1), split_im_(half_ + 1), re_(half_), im_(half_) {
+        const double pi = 3.14159265358979323846;
+        for (std::size_t i = 0; i < size_; ++i) {
+            window_[i] = static_cast<float>(0.5 - 0.5 * std::cos(2.0 * pi * i / size_)); // Hann
+        }
+        int bits = 0;
+        while ((std::size_t(1) << bits) < half_) ++bits;
+        for (std::size_t i = 0; i < half_; ++i) {
+            std::size_t reversed = 0;
+            for (int b = 0; b < bits; ++b) reversed |= ((i >> b) & 1) << (bits - 1 - b);
+            bit_reverse_[i] = static_cast<std::uint32_t>(reversed);
+        }
+        // The twiddles of the stage that combines pairs m apart, side by side from index
+        // m - 1, so each stage reads them as one contiguous array: w_j = e^(-2 pi i j / 2m).
+        for (std::size_t m = 1; m < half_; m *= 2) {
+            for (std::size_t j = 0; j < m; ++j) {
+                twiddle_re_[m - 1 + j] = static_cast<float>(std::cos(-pi * j / m));
+                twiddle_im_[m - 1 + j] = static_cast<float>(std::sin(-pi * j / m));
+            }
+        }
+        for (std::size_t k = 0; k <= half_; ++k) { // e^(-2 pi i k / size), for untangling
+            split_re_[k] = static_cast<float>(std::cos(-2.0 * pi * k / size_));
+            split_im_[k] = static_cast<float>(std::sin(-2.0 * pi * k / size_));
+        }
+    }
+
+    std::size_t size() const { return size_; }
+    std::size_t bins() const { return half_ + 1; }
+
+    // The magnitudes of the bins of the Hann-windowed 'samples' (size() of them), scaled
+    // so that a full-scale sine wave comes out as about 1.
+    void magnitudes(const float* samples, float* out) {
+        // Windowed, even samples as real parts and odd ones as imaginary parts, already
+        // in bit-reversed order.
+        for (std::size_t i = 0; i < half_; ++i) {
+            re_[bit_reverse_[i]] = samples[2 * i] * window_[2 * i];
+            im_[bit_reverse_[i]] = samples[2 * i + 1] * window_[2 * i + 1];
+        }
+        // The first two stages in one pass: their twiddles are just 1 and -i, and calling
+        // butterflies() for one or two pairs at a time would cost more than the work.
+        for (std::size_t start = 0; start + 4 <= half_; start += 4) {
+            float* r = &re_[start];
+            float* i = &im_[start];
+            float r0 = r[0] + r[1], i0 = i[0] + i[1], r1 = r[0] - r[1], i1 = i[0] - i[1];
+            float r2 = r[2] + r[3], i2 = i[2] + i[3], r3 = r[2] - r[3], i3 = i[2] - i[3];
+            r[0] = r0 + r2, i[0] = i0 + i2, r[2] = r0 - r2, i[2] = i0 - i2;
+            r[1] = r1 + i3, i[1] = i1 - r3, r[3] = r1 - i3, i[3] = i1 + r3; // Times -i
+        }
+        for (std::size_t m = 4; m < half_; m *= 2) {
+            for (std::size_t start = 0; start < half_; start += 2 * m) {
+                butterflies(&re_[start], &im_[start], &re_[start + m], &im_[start + m], &twiddle_re_[m - 1],
+                            &twiddle_im_[m - 1], m);
+            }
+        }
+        // Untangle: with Z the complex FFT, bin k of the real one is E + w^k * O, where
+        // E = (Z[k] + conj(Z[half - k])) / 2 is the transform of the even samples and
+        // O = (Z[k] - conj(Z[half - k])) / 2i the one of the odd samples.
+        const float scale = 4.0f / size_; // The Hann window halves the amplitude
+        for (std::size_t k = 0; k <= half_; ++k) {
+            std::size_t a = k % half_, b = (half_ - k) % half_;
+            float er = 0.5f * (re_[a] + re_[b]), ei = 0.5f * (im_[a] - im_[b]);
+            float or_ = 0.5f * (im_[a] + im_[b]), oi = -0.5f * (re_[a] - re_[b]);
+            float xr = er + split_re_[k] * or_ - split_im_[k] * oi;
+            float xi = ei + split_re_[k] * oi + split_im_[k] * or_;
+            out[k] = std::sqrt(xr * xr + xi * xi) * scale;
+        }
+    }
+
+private:
+    std::size_t size_, half_;
+    std::vector<float> window_;
+    std::vector<std::uint32_t> bit_reverse_;
+    std::vector<float> twiddle_re_, twiddle_im_; // The twiddles of all stages
+    std::vector<float> split_re_, split_im_;     // The twiddles for untangling
+    std::vector<float> re_, im_;                 // The data being transformed
+};
+
+// Turns the newest samples of every channel into the heights of the spectrum bars.
+class SpectrumAnalyzer {
+public:
+    SpectrumAnalyzer(unsigned int channels, unsigned int sampleRate)
+        : channels_(channels), fft_(FFT_SIZE), magnitudes_(fft_.bins()),
+          first_bin_(BAR_COUNT + 1), levels_(static_cast<std::size_t>(channels) * BAR_COUNT, 0.0f) {
+        // Bar b covers MIN_FREQUENCY * ratio^b up to MIN_FREQUENCY * ratio^(b + 1), with the
+        // ratio that makes the last bar end at half the sample rate. Every bar gets at
+        // least one bin (at the low end, a bin is wider than a bar would be).
+        float top = sampleRate / 2.0f;
+        for (int b = 0; b <= BAR_COUNT; ++b) {
+            float frequency = MIN_FREQUENCY * std::pow(top / MIN_FREQUENCY, static_cast<float>(b) / BAR_COUNT);
+            std::size_t bin = static_cast<std::size_t>(frequency * FFT_SIZE / sampleRate);
+            if (b > 0) bin = std::max(bin, first_bin_[b - 1] + 1);
+            first_bin_[b] = std::min(bin, fft_.bins());
+        }
+    }
+
+    // Analyzes the first FFT_SIZE frames of 'block'.
+    void analyze(const PlanarBuffer& block) {
+        for (unsigned int channel = 0; channel < channels_; ++channel) {
+            fft_.magnitudes(block.channel(channel), magnitudes_.data());
+            for (int b = 0; b < BAR_COUNT; ++b) {
+                float strongest = 0.0f;
+                for (std::size_t k = first_bin_[b]; k < first_bin_[b + 1]; ++k) strongest = std::max(strongest, magnitudes_[k]);
+                float db = 20.0f * std::log10(std::max(strongest, 1e-9f)); // 0 dB = a full-scale sine
+                float level = std::min(1.0f, std::max(0.0f, (db + DB_RANGE) / DB_RANGE));
+                float& bar = levels_[channel * BAR_COUNT + b];
+                bar = std::max(level, bar - BAR_FALL_PER_FRAME);
+            }
+        }
+    }
+
+    // The height of a bar, from 0 to 1.
+    float level(unsigned int channel, int bar) const { return levels_[channel * BAR_COUNT + bar]; }
+    unsigned int channels() const { return channels_; }
+
+private:
+    unsigned int channels_;
+    RealFft fft_;
+    std::vector<float> magnitudes_;     // Its bins
+    std::vector<std::size_t> first_bin_; // Bar b shows bins first_bin_[b] up to first_bin_[b + 1]
+    std::vector<float> levels_;         // The bars of all channels
+};
+
+// //////////////////////////////////////////////////////////////////////////////
+// // The spectrogram                                                          //
+// //////////////////////////////////////////////////////////////////////////////
+//
+// The bars show the spectrum of this moment only. A spectrogram shows its history: a
+// picture with time from left to right and frequency from bottom to top, where each
+// column is one spectrum and the color of each pixel says how loud that frequency
+// was then. A new column comes every SPECTROGRAM_HOP frames of audio (about 43 per
+// second), so a texture SPECTROGRAM_COLUMNS wide holds over three minutes.
+//
+// Redrawing minutes of spectra every frame would be a waste: nothing but the newest
+// column changes. So the texture is a circular buffer, like the ring buffer: column
+// 'head_' is the next one to write, and each new spectrum goes there, uploaded with
+// the update() that takes a rectangle one pixel wide. Nothing else is uploaded (but
+// after a seek, with the columns of an --analyze file, the whole texture is filled
+// once with what comes before the new position).
+// The scrolling comes for free: we draw one rectangle whose texture coordinates run
+// from a little before 'head_' up to 'head_'. With setRepeated(true), coordinates
+// past either edge of the texture continue at the other edge, so the wrap around the
+// end of the circle needs no special case.
+//
+// The rows are log-spaced from MIN_FREQUENCY up, like the bars, and the color of a
+// level comes from a table of SPECTROGRAM_COLORS colors, computed once: from black
+// through blue, red and yellow to white.
+//
+// The columns are computed on the analysis thread (SpectrogramColumns, see "The
+// pipeline") and travel to the window through a ring buffer of their own, where the
+// window's thread, which owns the texture, draws them in (Spectrogram).
+const sf::Uint64 SPECTROGRAM_HOP = FFT_SIZE / 4;  // Frames from one column to the next
+const unsigned int SPECTROGRAM_COLUMNS = 8192;   // Columns kept (at most; see the constructor)
+const unsigned int SPECTROGRAM_ROWS = 256;       // Frequencies per column
+const int SPECTROGRAM_COLORS = 256;              // Entries of the color table
+const int MAX_COLUMNS_PER_FRAME = 16;            // More than that is a jump, not playback
+const sf::Uint32 SPECTRA_VERSION = 1;            // Changes whenever the format below does
+
+// The start of a "<file>.spectra" file, written by --analyze (see "Batch analysis").
+// The columns of the whole track follow it, SPECTROGRAM_ROWS levels of a byte each,
+// the lowest frequency first; column c ends at frame (c + 1) * SPECTROGRAM_HOP. There
+// are no pointers and no variable-length parts, so the file can as well be mapped
+// into memory as it is.
+struct SpectraHeader {
+    char magic[4] = {'S', 'P', 'E', 'C'};
+    sf::Uint32 version = SPECTRA_VERSION;
+    sf::Uint32 rows = SPECTROGRAM_ROWS;
+    sf::Uint32 hop = static_cast<sf::Uint32>(SPECTROGRAM_HOP);
+    sf::Uint32 sample_rate = 0;
+    sf::Uint32 reserved = 0;      // Keeps the 64-bit numbers aligned
+    sf::Uint64 source_size = 0;   // The size and time of the audio file
+    sf::Int64 source_time = 0;
+    sf::Uint64 columns = 0;
+
+    bool matches(unsigned int rate, sf::Uint64 size, sf::Int64 time) const {
+        return std::memcmp(magic, "SPEC", 4) == 0 && version == SPECTRA_VERSION && rows == SPECTROGRAM_ROWS &&
+               hop == SPECTROGRAM_HOP && sample_rate == rate && source_size == size && source_time == time;
+    }
+};
+
+// Turns the bins of an FFT into the SPECTROGRAM_ROWS levels of a column, from 0 to
+// SPECTROGRAM_COLORS - 1, row 0 the lowest frequency. The spectrogram and the batch
+// analysis share it, so a column read from a file is what the window would compute.
+class SpectrogramRows {
+public:
+    SpectrogramRows(unsigned int sampleRate, std::size_t bins) : first_bin_(SPECTROGRAM_ROWS + 1) {
+        // Row r covers MIN_FREQUENCY * ratio^r up to MIN_FREQUENCY * ratio^(r + 1), as the
+        // bars do; at the low end, where a bin is taller than a row, rows share a bin.
+        float top = sampleRate / 2.0f;
+        for (unsigned int r = 0; r <= SPECTROGRAM_ROWS; ++r) {
+            float frequency = MIN_FREQUENCY * std::pow(top / MIN_FREQUENCY, static_cast<float>(r) / SPECTROGRAM_ROWS);
+            first_bin_[r] = std::min(static_cast<std::size_t>(frequency * FFT_SIZE / sampleRate), bins - 1);
+        }
+    }
+
+    void levels(const float* magnitudes, sf::Uint8* out) const {
+        for (unsigned int r = 0; r < SPECTROGRAM_ROWS; ++r) {
+            float strongest = 0.0f;
+            std::size_t last = std::max(first_bin_[r + 1], first_bin_[r] + 1);
+            for (std::size_t k = first_bin_[r]; k < last; ++k) strongest = std::max(strongest, magnitudes[k]);
+            float db = 20.0f * std::log10(std::max(strongest, 1e-9f));
+            float level = std::min(1.0f, std::max(0.0f, (db + DB_RANGE) / DB_RANGE));
+            out[r] = static_cast<sf::Uint8>(level * (SPECTROGRAM_COLORS - 1));
+        }
+    }
+
+private:
+    std::vector<std::size_t> first_bin_; // Row r shows bins first_bin_[r] up to first_bin_[r + 1]
+};
+
+// The columns of a whole track, from a "<file>.spectra" file. Loaded before playback
+// starts and never changed after, so both the analysis and the window may read it.
+class SpectraFile {
+public:
+    // Loads the file, if it belongs to this audio file (same size and time).
+    bool load(const std::string& path, unsigned int sample_rate, sf::Uint64 source_size, sf::Int64 source_time) {
+        SpectraHeader header;
+        std::ifstream file(path, std::ios::binary);
+        file.read(reinterpret_cast<char*>(&header), sizeof(header));
+        if (!file || !header.matches(sample_rate, source_size, source_time)) return false;
+        // The columns must fill the rest of the file exactly (as in PeakPyramid::load()).
+        std::streamoff start = file.tellg();
+        file.seekg(0, std::ios::end);
+        std::streamoff left = file.tellg() - start;
+        file.seekg(start);
+        if (!file || left < 0 || header.columns != static_cast<sf::Uint64>(left) / SPECTROGRAM_ROWS ||
+            static_cast<sf::Uint64>(left) % SPECTROGRAM_ROWS != 0) {
+            return false;
+        }
+        std::vector<sf::Uint8> levels(static_cast<std::size_t>(header.columns) * SPECTROGRAM_ROWS);
+        file.read(reinterpret_cast<char*>(levels.data()), static_cast<std::streamsize>(levels.size()));
+        if (!file) return false;
+        levels_.swap(levels);
+        return true;
+    }
+
+    bool empty() const { return levels_.empty(); }
+
+    // The levels of column 'index', or nullptr past the end (or before the start).
+    const sf::Uint8* column(sf::Int64 index) const {
+        if (index < 0 || static_cast<std::size_t>(index) >= levels_.size() / SPECTROGRAM_ROWS) return nullptr;
+        return &levels_[static_cast<std::size_t>(index) * SPECTROGRAM_ROWS];
+    }
+
+private:
+    std::vector<sf::Uint8> levels_;
+};
+
+// A new column, on its way from the analysis to the window.
+struct SpectrogramColumn {
+    sf::Uint64 end = 0;       // The frame it ends at
+    bool jump = false;        // Whether playback jumped to here (a seek, or the start)
+    bool from_file = false;   // Whether its levels came from the SpectraFile
+    sf::Uint8 levels[SPECTROGRAM_ROWS];
+};
+
+// The analysis half of the spectrogram: decides when a column is due and computes it
+// (or takes it from the SpectraFile). Columns end at multiples of SPECTROGRAM_HOP,
+// as in a file from --analyze.
+class SpectrogramColumns {
+public:
+    SpectrogramColumns(unsigned int channels, unsigned int sampleRate, const SpectraFile& spectra)
+        : spectra_(spectra), fft_(FFT_SIZE), block_(channels, FFT_SIZE), magnitudes_(fft_.bins()),
+          rows_(sampleRate, fft_.bins()) {}
+
+    // Queues the columns up to 'end' in 'out', one per SPECTROGRAM_HOP frames: each the
+    // spectrum of the FFT_SIZE frames (of all channels mixed) that end there. If the
+    // window falls so far behind that 'out' is full, columns are left out.
+    void update(const SampleHistory& history, sf::Uint64 end, float gain, SpscRing<SpectrogramColumn>& out) {
+        bool fromFile = !spectra_.empty() && gain == 1.0f; // The file's columns are at a gain of 1
+        if (end + SPECTROGRAM_HOP < next_end_ || end > next_end_ + MAX_COLUMNS_PER_FRAME * SPECTROGRAM_HOP) {
+            next_end_ = std::max(SPECTROGRAM_HOP, end - end % SPECTROGRAM_HOP); // A jump: carry on from here
+            jumped_ = true;
+        }
+        for (; next_end_ <= end; next_end_ += SPECTROGRAM_HOP) {
+            SpectrogramColumn* column = out.begin_push();
+            if (column == nullptr) continue;
+            const sf::Uint8* stored = fromFile ? spectra_.column(static_cast<sf::Int64>(next_end_ / SPECTROGRAM_HOP) - 1) : nullptr;
+            if (stored != nullptr) {
+                std::memcpy(column->levels, stored, SPECTROGRAM_ROWS);
+            } else {
+                // With silence before the start, as in the batch analysis
+                sf::Int64 first = static_cast<sf::Int64>(next_end_) - static_cast<sf::Int64>(FFT_SIZE);
+                history.read(first, FFT_SIZE, gain, block_);
+                fft_.magnitudes(block_.mix(), magnitudes_.data());
+                rows_.levels(magnitudes_.data(), column->levels);
+            }
+            column->end = next_end_;
+            column->jump = jumped_;
+            column->from_file = fromFile;
+            out.end_push();
+            jumped_ = false;
+        }
+    }
+
+private:
+    const SpectraFile& spectra_;
+    RealFft fft_;
+    PlanarBuffer block_;                    // The frames of one column
+    std::vector<float> magnitudes_;         // Its bins
+    SpectrogramRows rows_;
+    sf::Uint64 next_end_ = SPECTROGRAM_HOP; // The frame the next column ends at
+    bool jumped_ = false;                   // Whether the next column follows a jump
+};
+
+// The drawing half: the circular texture and the color table.
+class Spectrogram {
+public:
+    explicit Spectrogram(const SpectraFile& spectra)
+        : spectra_(spectra), colors_(SPECTROGRAM_COLORS), column_(SPECTROGRAM_ROWS * 4), quad_(sf::Quads, 4) {
+
+        // The color table: straight lines between these colors
+        const sf::Color stops[] = {sf::Color(0, 0, 0), sf::Color(20, 20, 140), sf::Color(160, 20, 140),
+                                   sf::Color(240, 60, 20), sf::Color(255, 210, 0), sf::Color(255, 255, 255)};
+        const int segments = sizeof(stops) / sizeof(stops[0]) - 1;
+        for (int i = 0; i < SPECTROGRAM_COLORS; ++i) {
+            float position = static_cast<float>(i) / (SPECTROGRAM_COLORS - 1) * segments;
+            int s = std::min(static_cast<int>(position), segments - 1);
+            float t = position - s;
+            auto mix = [t](sf::Uint8 a, sf::Uint8 b) { return static_cast<sf::Uint8>(a + (b - a) * t + 0.5f); };
+            colors_[i] = sf::Color(mix(stops[s].r, stops[s + 1].r), mix(stops[s].g, stops[s + 1].g),
+                                   mix(stops[s].b, stops[s + 1].b));
+        }
+
+        // The texture starts out black. (Big textures are limited on some graphics cards.)
+        columns_ = std::min(SPECTROGRAM_COLUMNS, sf::Texture::getMaximumSize());
+        texture_.create(columns_, SPECTROGRAM_ROWS);
+        std::vector<sf::Uint8> black(static_cast<std::size_t>(columns_) * SPECTROGRAM_ROWS * 4, 0);
+        for (std::size_t i = 3; i < black.size(); i += 4) black[i] = 255;
+        texture_.update(black.data());
+        texture_.setRepeated(true);
+        texture_.setSmooth(true);
+    }
+
+    unsigned int columns() const { return columns_; }
+
+    // Writes a column from SpectrogramColumns at 'head_'. After a jump, with the
+    // columns from the file, the texture is filled with what came before it first.
+    void add(const SpectrogramColumn& column) {
+        if (column.jump && column.from_file) fill_before(column.end);
+        paint(column.levels, column_.data(), 1);
+        texture_.update(column_.data(), 1, SPECTROGRAM_ROWS, head_, 0);
+        head_ = (head_ + 1) % columns_;
+    }
+
+    // Draws the newest 'visible' columns over the whole window.
+    void draw(sf::RenderTarget& target, unsigned int visible) {
+        float right = static_cast<float>(head_), left = right - static_cast<float>(visible);
+        float width = static_cast<float>(WINDOW_WIDTH), height = static_cast<float>(WINDOW_HEIGHT);
+        float rows = static_cast<float>(SPECTROGRAM_ROWS);
+        quad_[0] = sf::Vertex(sf::Vector2f(0.0f, 0.0f), sf::Vector2f(left, 0.0f));
+        quad_[1] = sf::Vertex(sf::Vector2f(width, 0.0f), sf::Vector2f(right, 0.0f));
+        quad_[2] = sf::Vertex(sf::Vector2f(width, height), sf::Vector2f(right, rows));
+        quad_[3] = sf::Vertex(sf::Vector2f(0.0f, height), sf::Vector2f(left, rows));
+        target.draw(quad_, &texture_);
+    }
+
+private:
+    // Turns 'count' columns of levels into pixels for columns of the texture that are
+    // 'count' wide: 'pixels' gets row after row, high frequencies at the top.
+    void paint(const sf::Uint8* levels, sf::Uint8* pixels, std::size_t count) const {
+        for (std::size_t c = 0; c < count; ++c) {
+            for (unsigned int r = 0; r < SPECTROGRAM_ROWS; ++r) {
+                const sf::Color& color = colors_[levels[c * SPECTROGRAM_ROWS + r]];
+                sf::Uint8* pixel = &pixels[((SPECTROGRAM_ROWS - 1 - r) * count + c) * 4];
+                pixel[0] = color.r;
+                pixel[1] = color.g;
+                pixel[2] = color.b;
+                pixel[3] = 255;
+            }
+        }
+    }
+
+    // Fills the whole texture with the precomputed columns that end before 'end' (and
+    // black before the start of the track), in one upload, so that the next column
+    // written, at 'head_', comes right after them.
+    void fill_before(sf::Uint64 end) {
+        std::vector<sf::Uint8> levels(static_cast<std::size_t>(columns_) * SPECTROGRAM_ROWS, 0);
+        sf::Int64 next = static_cast<sf::Int64>(end / SPECTROGRAM_HOP) - 1; // The index of the next column
+        for (unsigned int c = 0; c < columns_; ++c) {
+            // Texture column c is head_ + j for the j-th oldest; it shows column next - columns_ + j.
+            unsigned int j = (c + columns_ - head_) % columns_;
+            if (const sf::Uint8* stored = spectra_.column(next - columns_ + j)) {
+                std::memcpy(&levels[static_cast<std::size_t>(c) * SPECTROGRAM_ROWS], stored, SPECTROGRAM_ROWS);
+            }
+        }
+        std::vector<sf::Uint8> pixels(levels.size() * 4);
+        paint(levels.data(), pixels.data(), columns_);
+        texture_.update(pixels.data());
+    }
+
+    const SpectraFile& spectra_;
+    std::vector<sf::Color> colors_;      // The color table
+    std::vector<sf::Uint8> column_;      // One column of pixels, on its way to the texture
+    sf::Texture texture_;
+    sf::VertexArray quad_;
+    unsigned int columns_ = 0;           // The width of the texture
+    unsigned int head_ = 0;              // The column written next
+};
+
+// //////////////////////////////////////////////////////////////////////////////
+// // The overview                                                             //
+// //////////////////////////////////////////////////////////////////////////////
+//
+// The waveform shows MAX_SAMPLES_TO_DISPLAY samples, about 11 ms of audio. To show a
+// whole track, hours long, each column of pixels has to stand for thousands or
+// millions of samples, and what it should show is the range they cover: the lowest
+// and the highest sample (the "peaks"), and their RMS (root mean square, the square
+// root of the average squared sample), which is closer to how loud they sound.
+//
+// Going through millions of samples per column for every frame would be far too slow.
+// So we compute the peaks once, in a "pyramid": level 0 holds the min, max and sum of
+// squares of every block of PEAK_BLOCK_FRAMES frames, level 1 of every two level-0
+// blocks, level 2 of every two level-1 blocks, and so on. For any zoom, we take the
+// coarsest level whose blocks are no longer than a column; then each column combines
+// only two or three blocks, and drawing costs the same whether the window shows a
+// second or an hour. All levels together take only about twice the space of level 0,
+// which is about 1/5 byte per frame and channel.
+//
+// A file's pyramid is built on a thread of its own that decodes the whole file once,
+// while the window shows what is done so far. It is then saved next to the file (as
+// "<file>.peaks"), so opening the file again loads it instead of decoding everything.
+// Only level 0 is saved; the other levels are quick to rebuild from it. For live input
+// the pyramid grows with every chunk from the ring buffer. Either way the samples come
+// in as planar floats from convert_frames(), so a block's min, max and sum of squares
+// are three short loops over one array per channel.
+const sf::Uint64 PEAK_BLOCK_FRAMES = 64; // Frames per block of level 0
+const sf::Uint32 PEAK_CACHE_VERSION = 2;  // Changes whenever the cache format does
+
+// The lowest and highest sample of a stretch of one channel, and its energy.
+struct Peak {
+    float min = 0, max = 0; // From -1 to 1
+    sf::Uint32 frames = 0;  // How long the stretch is (0: no data)
+    float sum_squares = 0;  // Of its samples, each from -1 to 1
+
+    // Makes this the peak of both stretches together.
+    void add(const Peak& other) {
+        if (other.frames == 0) return;
+        if (frames == 0) {
+            *this = other;
+            return;
+        }
+        min = std::min(min, other.min);
+        max = std::max(max, other.max);
+        frames += other.frames;
+        sum_squares += other.sum_squares;
+    }
+
+    float rms() const { return frames > 0 ? std::sqrt(sum_squares / frames) : 0.0f; }
+};
+
+// The peak pyramid. append() and finish() may run on one thread while columns() runs
+// on another; a mutex keeps them apart (each holds it only briefly).
+class PeakPyramid {
+public:
+    explicit PeakPyramid(unsigned int channels) : channels_(channels), partial_(channels), levels_(1) {}
+
+    unsigned int channels() const { return channels_; }
+
+    // Adds 'count' frames at the end, one array per channel (as in a PlanarBuffer).
+    void append(const float* const* planes, std::size_t count) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (std::size_t i = 0; i < count;) {
+            // As much as fits into the block being filled
+            std::size_t n = std::min<std::size_t>(count - i, PEAK_BLOCK_FRAMES - partial_[0].frames);
+            for (unsigned int c = 0; c < channels_; ++c) {
+                const float* samples = planes[c] + i;
+                Peak peak{samples[0], samples[0], static_cast<sf::Uint32>(n), 0.0f};
+                for (std::size_t k = 0; k < n; ++k) peak.min = std::min(peak.min, samples[k]);
+                for (std::size_t k = 0; k < n; ++k) peak.max = std::max(peak.max, samples[k]);
+                for (std::size_t k = 0; k < n; ++k) peak.sum_squares += samples[k] * samples[k];
+                partial_[c].add(peak);
+            }
+            i += n;
+            if (partial_[0].frames == PEAK_BLOCK_FRAMES) add_block(partial_.data());
+        }
+    }
+
+    // Level 0, and the same added at the end (for pyramids built piece by piece, as in
+    // the batch analysis).
+    std::vector<Peak> blocks() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return levels_[0];
+    }
+    void append_blocks(const std::vector<Peak>& blocks) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (std::size_t b = 0; b + channels_ <= blocks.size(); b += channels_) add_block(&blocks[b]);
+    }
+
+    // Adds the frames left over at the end (a last block shorter than the others).
+    void finish() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (partial_[0].frames > 0) add_block(partial_.data());
+    }
+
+    // The frames in the pyramid so far.
+    sf::Uint64 frames() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return frames_;
+    }
+
+    // Fills 'out' with 'count' columns of 'channel': column c covers 'frames_per_column'
+    // frames from first + c * frames_per_column on.
+    void columns(unsigned int channel, double first, double frames_per_column, int count, Peak* out) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::size_t level = 0;
+        while (level + 1 < levels_.size() && (PEAK_BLOCK_FRAMES << (level + 1)) <= frames_per_column) ++level;
+        for (int c = 0; c < count; ++c) {
+            out[c] = Peak();
+            double from = first + c * frames_per_column, to = from + frames_per_column;
+            if (to <= 0) continue;
+            sf::Uint64 from_frame = static_cast<sf::Uint64>(std::max(from, 0.0));
+            add_range(channel, from_frame, std::max(from_frame + 1, static_cast<sf::Uint64>(std::ceil(to))), level, out[c]);
+        }
+    }
+
+    // Saves level 0 to 'path', with the size and time of the audio file it belongs to.
+    bool save(const std::string& path, sf::Uint64 source_size, sf::Int64 source_time) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::ofstream file(path, std::ios::binary);
+        sf::Uint64 count = levels_[0].size();
+        write(file, "PEAK", 4);
+        write(file, &PEAK_CACHE_VERSION, sizeof(PEAK_CACHE_VERSION));
+        write(file, &channels_, sizeof(channels_));
+        write(file, &source_size, sizeof(source_size));
+        write(file, &source_time, sizeof(source_time));
+        write(file, &count, sizeof(count));
+        write(file, levels_[0].data(), count * sizeof(Peak));
+        return static_cast<bool>(file);
+    }
+
+    // Loads what save() saved, if it belongs to this audio file (same size and time).
+    bool load(const std::string& path, sf::Uint64 source_size, sf::Int64 source_time) {
+        std::ifstream file(path, std::ios::binary);
+        char magic[4];
+        sf::Uint32 version = 0, channels = 0;
+        sf::Uint64 size = 0, count = 0;
+        sf::Int64 time = 0;
+        read(file, magic, 4);
+        read(file, &version, sizeof(version));
+        read(file, &channels, sizeof(channels));
+        read(file, &size, sizeof(size));
+        read(file, &time, sizeof(time));
+        read(file, &count, sizeof(count));
+        if (!file || std::string(magic, 4) != "PEAK" || version != PEAK_CACHE_VERSION || channels != channels_ ||
+            size != source_size || time != source_time || count % channels_ != 0) {
+            return false;
+        }
+        // The blocks must fill the rest of the file exactly. A damaged file could claim
+        // any count, and we would try to allocate that much.
+        std::streamoff start = file.tellg();
+        file.seekg(0, std::ios::end);
+        std::streamoff left = file.tellg() - start;
+        file.seekg(start);
+        if (!file || left < 0 || count != static_cast<sf::Uint64>(left) / sizeof(Peak) ||
+            static_cast<sf::Uint64>(left) % sizeof(Peak) != 0) {
+            return false;
+        }
+        std::vector<Peak> blocks(count);
+        read(file, blocks.data(), count * sizeof(Peak));
+        if (!file) return false;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        levels_.assign(1, std::vector<Peak>());
+        frames_ = 0;
+        for (sf::Uint64 b = 0; b < count; b += channels_) add_block(&blocks[b]);
+        return true;
+    }
+
+private:
+    // Adds the blocks of 'level' that overlap the frames from 'from' to 'to' to 'out'.
+    // At the end, where a level has no block yet (its pair isn't complete), the finer
+    // levels fill in. Called with the mutex held.
+    void add_range(unsigned int channel, sf::Uint64 from, sf::Uint64 to, std::size_t level, Peak& out) const {
+        const std::vector<Peak>& peaks = levels_[level];
+        const sf::Uint64 block = PEAK_BLOCK_FRAMES << level;
+        const sf::Uint64 blocks = peaks.size() / channels_;
+        sf::Uint64 b = from / block, end = (to + block - 1) / block;
+        for (; b < end && b < blocks; ++b) out.add(peaks[b * channels_ + channel]);
+        if (b < end && level > 0) add_range(channel, std::max(from, blocks * block), to, level - 1, out);
+    }
+
+    // Adds one block per channel to level 0, and to every level above that it completes.
+    // Called with the mutex held.
+    void add_block(const Peak* block) {
+        frames_ += block[0].frames;
+        levels_[0].insert(levels_[0].end(), block, block + channels_);
+        std::fill(partial_.begin(), partial_.end(), Peak());
+        for (std::size_t level = 0;; ++level) {
+            std::size_t blocks = levels_[level].size() / channels_;
+            if (blocks % 2 != 0) break; // The second of a pair completes a block above
+            if (level + 1 == levels_.size()) levels_.emplace_back();
+            for (unsigned int c = 0; c < channels_; ++c) {
+                Peak pair = levels_[level][(blocks - 2) * channels_ + c];
+                pair.add(levels_[level][(blocks - 1) * channels_ + c]);
+                levels_[level + 1].push_back(pair);
+            }
+        }
+    }
+
+    static void write(std::ofstream& file, const void* data, std::size_t size) {
+        file.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+    }
+    static void read(std::ifstream& file, void* data, std::size_t size) {
+        file.read(static_cast<char*>(data), static_cast<std::streamsize>(size));
+    }
+
+    unsigned int channels_;
+    std::vector<Peak> partial_;              // The block being filled, per channel
+    std::vector<std::vector<Peak>> levels_;  // levels_[level][block * channels_ + channel]
+    sf::Uint64 frames_ = 0;
+    mutable std::mutex mutex_;
+};
+
+// The size and time of a file, which say whether a cache still belongs to it.
+bool file_stamp(const std::string& path, sf::Uint64& size, sf::Int64& time) {
+    std::error_code error;
+    size = std::filesystem::file_size(path, error);
+    if (!error) time = std::filesystem::last_write_time(path, error).time_since_epoch().count();
+    return !error;
+}
+
+// Fills a PeakPyramid from an audio file, on a thread of its own: from the cache next
+// to the file if there is a valid one, otherwise by decoding the file (and then saving
+// the cache).
+class PyramidBuilder {
+public:
+    PyramidBuilder(PeakPyramid& pyramid, const std::string& path)
+        : thread_([this, &pyramid, path] { run(pyramid, path); }) {}
+
+    ~PyramidBuilder() {
+        stop_ = true; // Don't wait for the rest of a long file
+        thread_.join();
+    }
+
+private:
+    void run(PeakPyramid& pyramid, const std::string& path) {
+        sf::Uint64 size = 0;
+        sf::Int64 time = 0;
+        bool stamped = file_stamp(path, size, time);
+        std::string cache = path + ".peaks";
+        if (stamped && pyramid.load(cache, size, time)) return;
+
+        sf::InputSoundFile file;
+        if (!file.openFromFile(path)) return;
+        std::vector<sf::Int16> buffer(65536 / pyramid.channels() * pyramid.channels());
+        PlanarBuffer planar(pyramid.channels(), buffer.size() / pyramid.channels());
+        while (!stop_) {
+            std::size_t count = static_cast<std::size_t>(file.read(buffer.data(), buffer.size()));
+            if (count == 0) break;
+            planar.convert(buffer.data(), count / pyramid.channels(), 1.0f / 32768.0f);
+            pyramid.append(planar.planes(), count / pyramid.channels());
+        }
+        if (stop_) return; // Incomplete: don't save it
+        pyramid.finish();
+        if (stamped) pyramid.save(cache, size, time);
+    }
+
+    std::atomic<bool> stop_{false};
+    std::thread thread_; // Declared last, so it starts after everything else is ready
+};
+
+// //////////////////////////////////////////////////////////////////////////////
+// // Profiling                                                                //
+// //////////////////////////////////////////////////////////////////////////////
+//
+// Where does the time of a frame go? F3 shows it, with the overlay, timers and
+// percentiles of frame_profiler.hpp (which the Mandelbrot viewer uses too). The stages:
+// - events: pollEvent() and whatever the events do,
+// - samples: taking the chunks and spectrogram columns the analysis passed on, and
+//   uploading the samples to the GPU,
+// - analysis: one analyze() on the analysis thread, which times itself and sends the
+//   time along with its AnalysisFrame (frames the window skips aren't counted),
+// - vertices: filling the vertex arrays of the bars, the overview and the waveform,
+// - draw: clear() and every window.draw(), the overlay's own included,
+// - display: window.display(), which includes waiting for the frame rate limit.
+
+// //////////////////////////////////////////////////////////////////////////////
+// // The pipeline                                                             //
+// //////////////////////////////////////////////////////////////////////////////
+//
+// The work runs in three stages, each on a thread of its own, so that none waits for
+// another:
+//
+// 1. Ingest: SFML's audio thread (or the recorder's) puts every chunk into the ring
+//    buffer, as described in "Streaming the audio".
+// 2. Analysis: an AnalysisStage thread takes the chunks out, ANALYSIS_RATE times a
+//    second. It keeps the SampleHistory, asks the playback clock what we hear, converts
+//    the block around it, runs the FFT for the bars and the spectrogram, and adds live
+//    input to the peak pyramid. The result is an AnalysisFrame: everything the window
+//    needs to draw this moment.
+// 3. Render: the window's thread handles events and draws the newest AnalysisFrame.
+//
+// How does a finished frame get to the window? A mutex would let a slow analysis hold
+// up the drawing, which is what we want to avoid. Instead the frames go through a
+// "triple buffer": three AnalysisFrames, one the analysis is writing ("back"), one the
+// window is drawing ("front"), and one in between, the newest finished frame. When the
+// analysis finishes a frame, it swaps its back with the one in between, and marks it
+// as new; when the window starts a frame, it swaps its front with the one in between,
+// if that is new. Each swap is a single atomic exchange, so neither side ever waits,
+// and the window always gets the newest frame (frames it was too slow for are simply
+// skipped). All three frames are allocated at the start, so nothing is allocated
+// after that.
+//
+// Some things must not be skipped, though: each new spectrogram column, and each chunk
+// for the GPU's copy of the samples. Those travel through SPSC rings instead, as the
+// chunks do from the audio thread.
+const int ANALYSIS_RATE = 120; // Analysis frames per second, twice the frame rate
+
+// A triple buffer: one writer thread calls back() and publish(), one reader thread
+// update() and front().
+template <typename T>
+class TripleBuffer {
+public:
+    explicit TripleBuffer(const T& initial) : slots_{initial, initial, initial} {}
+
+    // Writer: the slot to fill, and handing it over as the newest.
+    T& back() { return slots_[back_]; }
+    void publish() { back_ = middle_.exchange(back_ | FRESH, std::memory_order_acq_rel) & INDEX; }
+
+    // Reader: takes the newest slot, if there is a new one since the last call, and
+    // returns whether there was.
+    bool update() {
+        if ((middle_.load(std::memory_order_relaxed) & FRESH) == 0) return false;
+        front_ = middle_.exchange(front_, std::memory_order_acq_rel) & INDEX;
+        return true;
+    }
+    const T& front() const { return slots_[front_]; }
+
+private:
+    static const unsigned int INDEX = 3; // The slot in between...
+    static const unsigned int FRESH = 4; // ...and whether the reader hasn't seen it yet
+
+    T slots_[3];
+    unsigned int back_ = 0;  // The writer's only
+    unsigned int front_ = 2; // The reader's only
+    alignas(64) std::atomic<unsigned int> middle_{1};
+};
+
+// What the window needs to draw one moment.
+struct AnalysisFrame {
+    sf::Uint64 current_frame = 0;  // The frame we hear
+    std::vector<float> waveform;   // The mix from there on...
+    int waveform_count = 0;        // ...of which we have this many
+    std::vector<float> bars;       // The spectrum: BAR_COUNT levels per channel
+    double analysis_ms = 0;        // How long the analysis took (see "Profiling")
+
+    explicit AnalysisFrame(unsigned int channels)
+        : waveform(MAX_SAMPLES_TO_DISPLAY), bars(static_cast<std::size_t>(channels) * BAR_COUNT) {}
+};
+
+// The analysis stage. 'stream' is nullptr for live input; then 'live_pyramid' gets
+// every chunk.
+class AnalysisStage {
+public:
+    AnalysisStage(SpscRing<AudioChunk>& input, FileStream* stream, PeakPyramid* live_pyramid, unsigned int channels,
+                  unsigned int sampleRate, const SpectraFile& spectra)
+        : input_(input), stream_(stream), pyramid_(live_pyramid), channels_(channels), history_(channels),
+          block_(channels, FFT_SIZE), incoming_(channels, CHUNK_SAMPLES), spectrum_(channels, sampleRate),
+          spectrogram_(channels, sampleRate, spectra), frames_(AnalysisFrame(channels)), chunks_(RING_CHUNKS),
+          columns_(RING_CHUNKS * 4), thread_([this] { run(); }) {}
+
+    ~AnalysisStage() {
+        stop_ = true;
+        thread_.join();
+    }
+
+    // For the window: the frames, and the chunks and spectrogram columns, in order.
+    TripleBuffer<AnalysisFrame>& frames() { return frames_; }
+    SpscRing<AudioChunk>& chunks() { return chunks_; }
+    SpscRing<SpectrogramColumn>& columns() { return columns_; }
+
+    // What the window tells the analysis.
+    void set_gain(float gain) { gain_.store(gain, std::memory_order_relaxed); }
+    void set_playing(bool playing) { playing_.store(playing, std::memory_order_relaxed); }
+
+private:
+    void run() {
+        const std::chrono::nanoseconds period(1000000000 / ANALYSIS_RATE);
+        auto next = std::chrono::steady_clock::now();
+        while (!stop_) {
+            analyze();
+            next += period;
+            auto now = std::chrono::steady_clock::now();
+            if (next < now) next = now; // Too slow this time: don't try to catch up
+            std::this_thread::sleep_until(next);
+        }
+    }
+
+    void analyze() {
+        auto started = std::chrono::steady_clock::now();
+
+        // Take the chunks the audio thread has delivered since the last time, and pass
+        // them on to the window.
+        while (const AudioChunk* chunk = input_.front()) {
+            history_.append(*chunk);
+            if (pyramid_ != nullptr) {
+                incoming_.convert(chunk->samples, chunk->sample_count / channels_, 1.0f / 32768.0f);
+                pyramid_->append(incoming_.planes(), chunk->sample_count / channels_);
+            }
+            if (AudioChunk* copy = chunks_.begin_push()) {
+                *copy = *chunk;
+                chunks_.end_push();
+            }
+            input_.pop();
+        }
+
+        // Find the samples to draw: from the frame we hear now for a file (the stream
+        // decodes a little ahead of that), the newest ones for live input.
+        float gain = gain_.load(std::memory_order_relaxed);
+        sf::Uint64 end = history_.end_frame(), currentFrame;
+        if (stream_ == nullptr) {
+            currentFrame = end - std::min<sf::Uint64>(end, MAX_SAMPLES_TO_DISPLAY);
+        } else {
+            // What we hear right now, from the playback clock (see PlaybackClock)
+            currentFrame = static_cast<sf::Uint64>(stream_->clock().frame(playing_.load(std::memory_order_relaxed)));
+        }
+        // The FFT_SIZE frames around what we hear now (the newest ones for live input),
+        // which include the ones the waveform draws.
+        sf::Uint64 blockFirst = stream_ == nullptr ? end - std::min<sf::Uint64>(end, FFT_SIZE)
+                                                   : currentFrame - std::min<sf::Uint64>(currentFrame, FFT_SIZE / 2);
+        history_.read(blockFirst, FFT_SIZE, gain, block_);
+        spectrum_.analyze(block_);
+        // The spectrogram keeps its history in every mode, up to the same moment.
+        spectrogram_.update(history_, stream_ == nullptr ? end : currentFrame + FFT_SIZE / 2, gain, columns_);
+
+        AnalysisFrame& frame = frames_.back();
+        frame.current_frame = currentFrame;
+        // Stop drawing where we're past what we have (past the end of the audio).
+        sf::Uint64 available = end - std::min(end, currentFrame);
+        frame.waveform_count = static_cast<int>(std::min<sf::Uint64>(MAX_SAMPLES_TO_DISPLAY, available));
+        const float* mix = block_.mix() + (currentFrame - blockFirst);
+        std::copy(mix, mix + frame.waveform_count, frame.waveform.begin());
+        for (unsigned int channel = 0; channel < channels_; ++channel) {
+            for (int b = 0; b < BAR_COUNT; ++b) frame.bars[channel * BAR_COUNT + b] = spectrum_.level(channel, b);
+        }
+        std::chrono::duration<double, std::milli> took = std::chrono::steady_clock::now() - started;
+        frame.analysis_ms = took.count();
+        frames_.publish();
+    }
+
+    SpscRing<AudioChunk>& input_;
+    FileStream* stream_;
+    PeakPyramid* pyramid_;
+    unsigned int channels_;
+    SampleHistory history_;
+    PlanarBuffer block_;          // The FFT_SIZE frames around what we hear
+    PlanarBuffer incoming_;       // A live chunk, for the pyramid
+    SpectrumAnalyzer spectrum_;
+    SpectrogramColumns spectrogram_;
+    TripleBuffer<AnalysisFrame> frames_;
+    SpscRing<AudioChunk> chunks_;            // To the window, for the GPU waveform
+    SpscRing<SpectrogramColumn> columns_;    // To the window, for the spectrogram
+    std::atomic<float> gain_{1.0f};
+    std::atomic<bool> playing_{false};
+    std::atomic<bool> stop_{false};
+    std::thread thread_; // Declared last, so it starts after everything else is ready
+};
+
+// //////////////////////////////////////////////////////////////////////////////
+// // Batch analysis                                                           //
+// //////////////////////////////////////////////////////////////////////////////
+//
+// "--analyze" does the window's work for a whole list of files ahead of time, with
+// no window: for each file the peak pyramid (whose level 0 is also the RMS envelope,
+// every PEAK_BLOCK_FRAMES frames) and the spectrogram columns of the whole track. It
+// writes them next to the file as "<file>.peaks" and "<file>.spectra", which the
+// viewer loads instead of decoding the file again: the overview is there at once, and
+// the spectrogram shows what came before a seek.
+//
+// Each file is decoded once, from start to end, with an sf::InputSoundFile, in pieces
+// of ANALYSIS_CHUNK_FRAMES frames. Decoding has to go in order, but the analysis of a
+// piece doesn't depend on the others, so every piece becomes a task of its own for a
+// pool of threads, and several files are decoded at the same time. Each piece is a
+// whole number of peak blocks and of spectrogram hops, so its results fit right
+// after those of the piece before; a piece also carries the FFT_SIZE frames before
+// it, for the first spectra that reach back into the previous piece.
+//
+// The decoding of a file is a task too, one piece at a time: after a piece, it queues
+// the piece's analysis and then the decoding of the next piece. So nothing ever waits
+// for anything. If a file has MAX_PIECES_IN_FLIGHT pieces that are not analyzed yet,
+// the decoding pauses, and the analysis that finishes next continues it; that keeps
+// the memory bounded however fast the decoder is.
+const std::size_t ANALYSIS_CHUNK_FRAMES = 1 << 16; // Frames per piece (a multiple of both)
+const std::size_t MAX_PIECES_IN_FLIGHT = 8;        // Per file
+
+// A pool of threads that run queued tasks.
+class TaskPool {
+public:
+    explicit TaskPool(unsigned int threads) {
+        for (unsigned int i = 0; i < std::max(1u, threads); ++i) threads_.emplace_back([this] { run(); });
+    }
+
+    ~TaskPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (std::thread& thread : threads_) thread.join();
+    }
+
+    void submit(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            tasks_.push_back(std::move(task));
+        }
+        wake_.notify_one();
+    }
+
+    // Waits until every task has run, including the ones tasks queued.
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        idle_.wait(lock, [this] { return tasks_.empty() && running_ == 0; });
+    }
+
+private:
+    void run() {
+        for (;;) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
+                if (tasks_.empty()) return; // Stopping
+                task = std::move(tasks_.front());
+                tasks_.pop_front();
+                ++running_;
+            }
+            task();
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (--running_ == 0 && tasks_.empty()) idle_.notify_all();
+        }
+    }
+
+    std::vector<std::thread> threads_;
+    std::deque<std::function<void()>> tasks_;
+    std::mutex mutex_;
+    std::condition_variable wake_; // A task was queued (or we stop)
+    std::condition_variable idle_; // Nothing queued and nothing running
+    unsigned int running_ = 0;
+    bool stop_ = false;
+};
+
+// The analysis of one file. start() queues the decoding of its first piece; the file
+// is done (and written) when the last piece has been analyzed.
+class TrackAnalysis {
+public:
+    TrackAnalysis(TaskPool& pool, const std::string& path) : pool_(pool), path_(path) {}
+
+    // Opens the file and starts decoding. False if it can't be opened.
+    bool start() {
+        if (!file_.openFromFile(path_) || !file_stamp(path_, size_, time_)) return false;
+        channels_ = file_.getChannelCount();
+        sample_rate_ = file_.getSampleRate();
+        overlap_.assign(static_cast<std::size_t>(FFT_SIZE) * channels_, 0); // Silence before the start
+        pool_.submit([this] { decode(); });
+        return true;
+    }
+
+    // Whether both files were written (once the pool is done).
+    bool succeeded() const { return succeeded_; }
+    const std::string& path() const { return path_; }
+
+private:
+    // A decoded piece: FFT_SIZE frames from before it, then its own frames.
+    struct Piece {
+        std::size_t index = 0;
+        sf::Uint64 first_frame = 0;
+        std::size_t frames = 0;
+        std::vector<sf::Int16> samples;
+    };
+
+    // Decodes the next piece and queues its analysis, then (unless too many pieces are
+    // waiting) the decoding of the one after.
+    void decode() {
+        auto piece = std::make_shared<Piece>();
+        piece->samples = overlap_;
+        piece->samples.resize(overlap_.size() + ANALYSIS_CHUNK_FRAMES * channels_);
+        std::size_t count = static_cast<std::size_t>(
+            file_.read(&piece->samples[overlap_.size()], ANALYSIS_CHUNK_FRAMES * channels_));
+        piece->frames = count / channels_;
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (piece->frames == 0) {
+            decoded_ = true;
+            if (in_flight_ == 0) {
+                lock.unlock();
+                finish();
+            }
+            return;
+        }
+        piece->index = blocks_.size();
+        piece->first_frame = next_frame_;
+        next_frame_ += piece->frames;
+        blocks_.emplace_back();
+        columns_.emplace_back();
+        ++in_flight_;
+        // The last FFT_SIZE frames are the next piece's overlap.
+        std::size_t end = overlap_.size() + piece->frames * channels_;
+        overlap_.assign(piece->samples.begin() + (end - overlap_.size()), piece->samples.begin() + end);
+        bool more = in_flight_ < MAX_PIECES_IN_FLIGHT;
+        paused_ = !more;
+        lock.unlock();
+
+        pool_.submit([this, piece] { analyze(*piece); });
+        if (more) pool_.submit([this] { decode(); });
+    }
+
+    // The peak blocks and spectrogram columns of one piece.
+    void analyze(const Piece& piece) {
+        std::size_t total = FFT_SIZE + piece.frames;
+        PlanarBuffer planar(channels_, total);
+        planar.convert(piece.samples.data(), total, 1.0f / 32768.0f);
+
+        PeakPyramid peaks(channels_);
+        std::vector<const float*> planes(channels_);
+        for (unsigned int c = 0; c < channels_; ++c) planes[c] = planar.channel(c) + FFT_SIZE;
+        peaks.append(planes.data(), piece.frames);
+        peaks.finish(); // Only the last piece has a partial block
+
+        // Column c ends at (c + 1) * SPECTROGRAM_HOP; these are the ones that end in this
+        // piece. The frames of column 'end' start at planar index end - first_frame.
+        RealFft fft(FFT_SIZE);
+        SpectrogramRows rows(sample_rate_, fft.bins());
+        std::vector<float> magnitudes(fft.bins());
+        std::vector<sf::Uint8> columns;
+        sf::Uint64 end = (piece.first_frame / SPECTROGRAM_HOP + 1) * SPECTROGRAM_HOP;
+        for (; end <= piece.first_frame + piece.frames; end += SPECTROGRAM_HOP) {
+            fft.magnitudes(planar.mix() + (end - piece.first_frame), magnitudes.data());
+            columns.resize(columns.size() + SPECTROGRAM_ROWS);
+            rows.levels(magnitudes.data(), &columns[columns.size() - SPECTROGRAM_ROWS]);
+        }
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        blocks_[piece.index] = peaks.blocks();
+        columns_[piece.index].swap(columns);
+        --in_flight_;
+        bool resume = paused_;
+        paused_ = false;
+        bool last = decoded_ && in_flight_ == 0;
+        lock.unlock();
+        if (resume) pool_.submit([this] { decode(); });
+        if (last) finish();
+    }
+
+    // Puts the pieces together and writes both files.
+    void finish() {
+        PeakPyramid pyramid(channels_);
+        SpectraHeader header;
+        header.sample_rate = sample_rate_;
+        header.source_size = size_;
+        header.source_time = time_;
+        for (const std::vector<Peak>& blocks : blocks_) pyramid.append_blocks(blocks);
+        for (const std::vector<sf::Uint8>& columns : columns_) header.columns += columns.size() / SPECTROGRAM_ROWS;
+
+        std::ofstream spectra(path_ + ".spectra", std::ios::binary);
+        spectra.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        for (const std::vector<sf::Uint8>& columns : columns_) {
+            spectra.write(reinterpret_cast<const char*>(columns.data()), static_cast<std::streamsize>(columns.size()));
+        }
+        succeeded_ = pyramid.save(path_ + ".peaks", size_, time_) && static_cast<bool>(spectra);
+    }
+
+    TaskPool& pool_;
+    std::string path_;
+    sf::InputSoundFile file_;           // Only the decoding task touches it
+    std::vector<sf::Int16> overlap_;    // The last FFT_SIZE frames decoded (decoding task only)
+    unsigned int channels_ = 1, sample_rate_ = 44100;
+    sf::Uint64 size_ = 0;
+    sf::Int64 time_ = 0;
+
+    std::mutex mutex_;                  // Guards the rest
+    std::vector<std::vector<Peak>> blocks_;       // Per piece: its level-0 peak blocks...
+    std::vector<std::vector<sf::Uint8>> columns_; // ...and its spectrogram columns
+    sf::Uint64 next_frame_ = 0;
+    std::size_t in_flight_ = 0;         // Pieces decoded but not analyzed yet
+    bool paused_ = false;               // Whether the decoding waits for an analysis
+    bool decoded_ = false;              // Whether the whole file is decoded
+    bool succeeded_ = false;
+};
+
+// --analyze: analyzes every file, all at once on a pool of threads.
+int run_analysis(const std::vector<std::string>& paths) {
+    auto started = std::chrono::steady_clock::now();
+    TaskPool pool(std::thread::hardware_concurrency());
+    std::vector<std::unique_ptr<TrackAnalysis>> tracks;
+    for (const std::string& path : paths) {
+        tracks.emplace_back(new TrackAnalysis(pool, path));
+        if (!tracks.back()->start()) std::cerr << "Can't open " << path << "\n";
+    }
+    pool.wait();
+
+    int failed = 0;
+    for (const std::unique_ptr<TrackAnalysis>& track : tracks) {
+        std::cout << (track->succeeded() ? "done:   " : "failed: ") << track->path() << "\n";
+        if (!track->succeeded()) ++failed;
+    }
+    std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - started;
+    std::cout << paths.size() << " files in " << seconds.count() << " s\n";
+    return failed == 0 ? 0 : 1;
+}
+
+// //////////////////////////////////////////////////////////////////////////////
+// // Benchmarks                                                               //
+// //////////////////////////////////////////////////////////////////////////////
+//
+// "--bench-json" times the kernels every frame depends on, with no window and no
+// audio device, on made-up samples:
+// - convert: 16-bit samples to planar floats, for FFT_SIZE frames (mono and stereo
+//   take SSE2 or NEON, the 6 channels of 5.1 audio the plain loop),
+// - fft: the magnitudes of one channel's FFT_SIZE frames,
+// - spectrum: the whole SpectrumAnalyzer for a stereo block, window and bars included,
+// - peaks append: adding FFT_SIZE stereo frames to a peak pyramid,
+// - peaks columns: a window's width of overview columns from that pyramid.
+// It prints the results as JSON on standard output (and progress on standard error),
+// so that a script can save them and compare each version with the last:
+//    ./visualizer --bench-json > results.json
+//
+// Each kernel first runs BENCH_WARMUP times, to get its data into the caches and to
+// give the CPU time to raise its clock, then BENCH_REPEATS more times, each of them
+// timed. The results are the median and the 99th percentile of those times, as in the
+// overlay, and the fastest; "ns_per_frame" is the median divided by the frames one
+// call handles. The median is the number to compare; p99 shows whether the kernel is
+// steady, which matters as much here, since a frame waits for the slowest one.
+const int BENCH_WARMUP = 50;
+const int BENCH_REPEATS = 1000;
+
+int run_json_benchmark() {
+    const unsigned int maxChannels = 6;
+    std::vector<sf::Int16> samples(static_cast<std::size_t>(FFT_SIZE) * maxChannels);
+    for (std::size_t i = 0; i < samples.size(); ++i) { // Two tones and a little noise
+        double tone = 12000.0 * std::sin(0.031 * i) + 6000.0 * std::sin(0.47 * i);
+        samples[i] = static_cast<sf::Int16>(tone + static_cast<double>((i * 7919) % 2001) - 1000.0);
+    }
+
+    std::vector<double> times(BENCH_REPEATS);
+    bool first = true;
+    auto bench = [&](const char* kernel, unsigned int channels, double frames, const std::function<void()>& run) {
+        for (int i = 0; i < BENCH_WARMUP; ++i) run();
+        for (int i = 0; i < BENCH_REPEATS; ++i) {
+            auto start = std::chrono::steady_clock::now();
+            run();
+            times[i] = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        }
+        double fastest = *std::min_element(times.begin(), times.end());
+        double median = percentile(times, 0.50), p99 = percentile(times, 0.99);
+        std::cout << (first ? "\n" : ",\n") << "    {\"kernel\": \"" << kernel << "\", \"channels\": " << channels
+                  << ", \"frames\": " << frames << ", \"median_ns\": " << median << ", \"p99_ns\": " << p99
+                  << ", \"min_ns\": " << fastest << ", \"ns_per_frame\": " << median / frames << "}";
+        first = false;
+        std::cerr << kernel << ", " << channels << " channels: " << median << " ns (p99 " << p99 << " ns)\n";
+    };
+
+#if defined(VISUALIZER_SSE)
+    const char* simd = "sse2";
+#elif defined(VISUALIZER_NEON)
+    const char* simd = "neon";
+#else
+    const char* simd = "none";
+#endif
+    std::cout << "{\n  \"fft_size\": " << FFT_SIZE << ",\n  \"simd\": \"" << simd << "\",\n  \"warmup\": "
+              << BENCH_WARMUP << ",\n  \"repeats\": " << BENCH_REPEATS << ",\n  \"results\": [";
+
+    for (unsigned int channels : {1u, 2u, maxChannels}) {
+        PlanarBuffer block(channels, FFT_SIZE);
+        bench("convert", channels, FFT_SIZE, [&] { block.convert(samples.data(), FFT_SIZE, 1.0f / 32768.0f); });
+    }
+
+    PlanarBuffer stereo(2, FFT_SIZE);
+    stereo.convert(samples.data(), FFT_SIZE, 1.0f / 32768.0f);
+    RealFft fft(FFT_SIZE);
+    std::vector<float> magnitudes(fft.bins());
+    bench("fft", 1, FFT_SIZE, [&] { fft.magnitudes(stereo.channel(0), magnitudes.data()); });
+    SpectrumAnalyzer spectrum(2, 44100);
+    bench("spectrum", 2, FFT_SIZE, [&] { spectrum.analyze(stereo); });
+
+    PeakPyramid pyramid(2);
+    bench("peaks append", 2, FFT_SIZE, [&] { pyramid.append(stereo.planes(), FFT_SIZE); });
+    std::vector<Peak> columns(WINDOW_WIDTH);
+    double perColumn = static_cast<double>(pyramid.frames()) / WINDOW_WIDTH;
+    bench("peaks columns", 2, static_cast<double>(pyramid.frames()), [&] {
+        for (unsigned int c = 0; c < 2; ++c) pyramid.columns(c, 0.0, perColumn, WINDOW_WIDTH, columns.data());
+    });
+
+    std::cout << "\n  ]\n}\n";
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    // "--analyze FILE..." analyzes files ahead of time, with no window (see "Batch
+    // analysis").
+    if (argc > 1 && std::string(argv[1]) == "--analyze") {
+        return run_analysis(std::vector<std::string>(argv + 2, argv + argc));
+    }
+    // "--bench-json" times the kernels and prints the results as JSON (see "Benchmarks").
+    if (argc > 1 && std::string(argv[1]) == "--bench-json") {
+        return run_json_benchmark();
+    }
+
     // 1. Set up the SFML Window
     // This creates our graphical window where the visualization will be displayed.
-    sf::RenderWindow window(sf::VideoMode(WINDOW_WIDTH, WINDOW_HEIGHT), "SFML Audio Visualizer");
+    sf::RenderWindow window(sf::VideoMode(WINDOW_WIDTH, WINDOW_HEIGHT), WINDOW_TITLE);
     window.setFramerateLimit(60); // Limit frame rate for smoother rendering
 
-    // 2. Load the Audio File
-    // We need an audio file to visualize. SFML supports various formats like WAV, OGG, etc.
+    // 2. Open the Audio Source
+    // Either an audio file, streamed from disk while it plays (SFML supports various
+    // formats like WAV, OGG, etc.), or with "--mic" the live input of the default
+    // recording device. Both deliver their samples into the same ring buffer.
     // Make sure 'your_audio_file.ogg' is in the same directory as your executable
-    // or provide the correct path.
-    sf::Music music;
-    if (!music.openFromFile("your_audio_file.ogg")) { // Replace with your audio file
-        // If the file cannot be opened, print an error and exit.
-        // This is crucial for debugging.
-        return -1; // Indicate an error
+    // or provide the correct path on the command line. "--latency MS" sets the output
+    // latency the playback clock allows for.
+    bool live = false;
+    std::string path = "your_audio_file.ogg"; // Replace with your audio file
+    float latency = OUTPUT_LATENCY;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--mic") {
+            live = true;
+        } else if (arg == "--latency" && i + 1 < argc) {
+            latency = std::strtof(argv[++i], nullptr) / 1000.0f;
+        } else {
+            path = arg;
+        }
+    }
+    SpscRing<AudioChunk> ring(RING_CHUNKS);
+    FileStream stream(ring);
+    MicrophoneInput microphone(ring);
+    unsigned int sampleRate, channels;
+    if (live) {
+        if (!sf::SoundRecorder::isAvailable() || !microphone.start(MIC_SAMPLE_RATE)) {
+            return -1; // No recording device
+        }
+        sampleRate = microphone.getSampleRate();
+        channels = 1;
+    } else {
+        if (!stream.open(path)) {
+            // If the file cannot be opened, print an error and exit.
+            // This is crucial for debugging.
+            return -1; // Indicate an error
+        }
+        sampleRate = stream.getSampleRate(); // How many frames are played per second
+        stream.clock().configure(sampleRate, latency);
+        // Every channel is kept: the bars and the GPU waveform show each of them, and
+        // the CPU waveform draws their mix.
+        channels = stream.getChannelCount();
     }
 
     // 3. Prepare for Audio Data Retrieval
-    // SFML's sf::Music provides a way to get the raw audio samples.
-    // We'll use this to determine the amplitude.
-    // getSampleCount() tells us the total number of samples in the audio.
-    // getSampleRate() tells us how many samples are played per second.
-    // getChannelCount() tells us if it's mono (1) or stereo (2). We'll use the first channel.
-    const sf::Int16* samples = music.getSamples(); // Get a pointer to the raw audio data
-    sf::Uint32 numSamples = music.getSampleCount();
-    unsigned int sampleRate = music.getSampleRate();
-
-    // If the audio is stereo, we only need one channel for a simple visualizer.
-    // We'll use the first channel (index 0).
-    unsigned int channels = music.getChannelCount();
+    // The analysis runs on a thread of its own (see "The pipeline"); here we keep the
+    // peaks of everything for the overview: of the whole file, built in the background,
+    // or of everything recorded so far, and the columns --analyze may have left for the
+    // spectrogram. 'gain' scales what the waveform and the spectrum show.
+    float gain = 1.0f; // Up and Down change it
+    PeakPyramid pyramid(channels);
+    std::unique_ptr<PyramidBuilder> builder;
+    if (!live) builder.reset(new PyramidBuilder(pyramid, path));
+    SpectraFile spectra;
+    sf::Uint64 fileSize = 0;
+    sf::Int64 fileTime = 0;
+    if (!live && file_stamp(path, fileSize, fileTime)) {
+        spectra.load(path + ".spectra", sampleRate, fileSize, fileTime); // If --analyze left one
+    }
+    AnalysisStage analysis(ring, live ? nullptr : &stream, live ? &pyramid : nullptr, channels, sampleRate, spectra);
 
     // 4. Prepare for Graphics Rendering
     // We'll use sf::VertexArray to draw lines representing the waveform.
     // sf::Lines means we draw pairs of vertices as individual lines.
     sf::VertexArray waveform(sf::Lines, MAX_SAMPLES_TO_DISPLAY * 2);
+    // If the graphics card can, it draws the waveform instead, of every channel and of
+    // GPU_WAVEFORM_FRAMES frames (see GpuWaveform); G switches between the two. It
+    // keeps its own history of the chunks the analysis passes on.
+    SampleHistory shown(channels);
+    GpuWaveform gpuWaveform(channels);
+    bool gpuAvailable = gpuWaveform.create();
+    bool useGpu = gpuAvailable;
+    // The spectrum: BAR_COUNT bars per channel, each a rectangle of 4 vertices (sf::Quads).
+    // The channels take turns from the top of the window down.
+    sf::VertexArray bars(sf::Quads, static_cast<std::size_t>(channels) * BAR_COUNT * 4);
+    // The overview: per channel and column a line from the lowest to the highest sample,
+    // with a shorter line for the RMS on top, and a line where we are.
+    // The spectrogram: one texture, drawn as one rectangle; the mouse wheel changes how
+    // many of its columns the window shows.
+    Spectrogram spectrogram(spectra);
+    unsigned int spectrogramColumns = WINDOW_WIDTH;
+    std::vector<Peak> columnPeaks(WINDOW_WIDTH);
+    sf::VertexArray overview(sf::Lines, static_cast<std::size_t>(channels) * WINDOW_WIDTH * 4 + 2);
+    double overviewFirst = 0;          // The frame at the left edge of the overview...
+    double overviewFramesPerColumn = 0; // ...and the frames per column (0: the whole track)
+
+    enum Mode { Waveform, Spectrum, SpectrogramMode, Overview };
+    Mode mode = Waveform; // M switches to the next one
+
+    // The times of each stage of the frame; F3 shows them (see "Profiling").
+    enum Stage { Events, Samples, Analysis, Vertices, Draw, Display };
+    Profiler profiler({"events", "samples", "analysis", "vertices", "draw", "display"});
+    bool profiling = false;
 
     // 5. The Main Application Loop
     // This loop continues as long as the window is open.
     while (window.isOpen()) {
         // 6. Event Handling
         // We process events like closing the window or pressing keys.
-        sf::Event event;
-        while (window.pollEvent(event)) {
-            if (event.type == sf::Event::Closed) {
-                window.close(); // Close the window if the user clicks the close button.
-            }
-            // Basic control: Spacebar to play/pause
-            if (event.type == sf::Event::KeyPressed) {
-                if (event.key.code == sf::Keyboard::Space) {
-                    if (music.getStatus() == sf::Music::Playing) {
-                        music.pause(); // Pause the music if it's playing.
+        // (The overview shows the whole track in 'wholeTrack' frames per column.)
+        double trackFrames = live ? static_cast<double>(pyramid.frames()) : static_cast<double>(stream.frame_count());
+        double wholeTrack = std::max(trackFrames / WINDOW_WIDTH, static_cast<double>(PEAK_BLOCK_FRAMES));
+        {
+            ScopedTimer timer(profiler[Events]);
+            sf::Event event;
+            while (window.pollEvent(event)) {
+                if (event.type == sf::Event::Closed) {
+                    window.close(); // Close the window if the user clicks the close button.
+                }
+                if (event.type == sf::Event::KeyPressed && event.key.code == sf::Keyboard::M) {
+                    mode = mode == Waveform ? Spectrum : mode == Spectrum ? SpectrogramMode
+                                                       : mode == SpectrogramMode ? Overview : Waveform;
+                }
+                if (event.type == sf::Event::KeyPressed && event.key.code == sf::Keyboard::G) {
+                    useGpu = gpuAvailable && !useGpu;
+                }
+                if (event.type == sf::Event::KeyPressed && event.key.code == sf::Keyboard::F3) {
+                    profiling = !profiling;
+                    if (!profiling) window.setTitle(WINDOW_TITLE); // Without the numbers
+                }
+                if (event.type == sf::Event::KeyPressed && event.key.code == sf::Keyboard::Up) {
+                    gain = std::min(gain * 1.25f, 64.0f);
+                    analysis.set_gain(gain);
+                }
+                if (event.type == sf::Event::KeyPressed && event.key.code == sf::Keyboard::Down) {
+                    gain = std::max(gain / 1.25f, 1.0f / 64.0f);
+                    analysis.set_gain(gain);
+                }
+                if (mode == SpectrogramMode && event.type == sf::Event::MouseWheelScrolled) {
+                    float columns = spectrogramColumns * std::pow(0.8f, event.mouseWheelScroll.delta);
+                    spectrogramColumns = static_cast<unsigned int>(std::min(std::max(columns, 64.0f),
+                                                                            static_cast<float>(spectrogram.columns())));
+                }
+                // In the overview, the mouse wheel zooms around the pointer, and a click
+                // jumps to that point of the track.
+                if (mode == Overview && event.type == sf::Event::MouseWheelScrolled) {
+                    double perColumn = overviewFramesPerColumn > 0 ? overviewFramesPerColumn : wholeTrack;
+                    double anchor = overviewFirst + event.mouseWheelScroll.x * perColumn;
+                    perColumn = std::max(perColumn * std::pow(0.8, event.mouseWheelScroll.delta),
+                                         static_cast<double>(PEAK_BLOCK_FRAMES));
+                    if (perColumn >= wholeTrack) {
+                        overviewFramesPerColumn = 0; // Zoomed all the way out
                     } else {
-                        music.play();  // Play the music if it's paused or stopped.
+                        overviewFramesPerColumn = perColumn;
+                        overviewFirst = anchor - event.mouseWheelScroll.x * perColumn;
+                    }
+                }
+                if (mode == Overview && !live && event.type == sf::Event::MouseButtonPressed &&
+                    event.mouseButton.button == sf::Mouse::Left) {
+                    double perColumn = overviewFramesPerColumn > 0 ? overviewFramesPerColumn : wholeTrack;
+                    double first = overviewFramesPerColumn > 0 ? overviewFirst : 0.0;
+                    double frame = std::max(0.0, first + event.mouseButton.x * perColumn);
+                    stream.setPlayingOffset(sf::seconds(static_cast<float>(frame / sampleRate)));
+                }
+                // Basic control: Spacebar to play/pause (a live input just keeps going)
+                if (event.type == sf::Event::KeyPressed && !live) {
+                    if (event.key.code == sf::Keyboard::Space) {
+                        if (stream.getStatus() == sf::SoundStream::Playing) {
+                            stream.pause(); // Pause the music if it's playing.
+                        } else {
+                            stream.play();  // Play the music if it's paused or stopped.
+                        }
                     }
                 }
             }
         }
 
         // 7. Audio Processing and Visualization Logic
-        // We need to get the current audio position and extract a chunk of samples
-        // to visualize.
-        sf::Time currentTime = music.getPlayingOffset();
-        sf::Uint32 currentSampleIndex = static_cast<sf::Uint32>(currentTime.asSeconds() * sampleRate);
-
-        // Ensure we don't go out of bounds
-        if (currentSampleIndex >= numSamples) {
-            currentSampleIndex = numSamples - 1; // Clamp to the last sample
+        // The analysis thread does the work; we take the newest frame it finished (or
+        // keep the last one, if it hasn't finished a new one), and the chunks and
+        // spectrogram columns it passed on since the last time.
+        if (!live) analysis.set_playing(stream.getStatus() == sf::SoundStream::Playing);
+        if (analysis.frames().update()) profiler[Analysis].add(analysis.frames().front().analysis_ms);
+        const AnalysisFrame& frame = analysis.frames().front();
+        sf::Uint64 currentFrame = frame.current_frame;
+        {
+            ScopedTimer timer(profiler[Samples]);
+            while (const AudioChunk* chunk = analysis.chunks().front()) {
+                shown.append(*chunk);
+                analysis.chunks().pop();
+            }
+            if (gpuAvailable) gpuWaveform.upload(shown);
+            while (const SpectrogramColumn* column = analysis.columns().front()) {
+                spectrogram.add(*column);
+                analysis.columns().pop();
+            }
         }
 
-        // Iterate through a limited number of samples to draw.
-        // This creates a scrolling effect.
-        for (int i = 0; i < MAX_SAMPLES_TO_DISPLAY; ++i) {
-            sf::Uint32 sampleIndex = currentSampleIndex + i;
-
-            // Check if we've reached the end of the audio
-            if (sampleIndex >= numSamples) {
-                break; // Stop drawing if we're past the end
+        {
+            ScopedTimer timer(profiler[Vertices]);
+            if (mode == Spectrum) {
+                // The spectrum of the block around what we hear
+                float bandHeight = static_cast<float>(WINDOW_HEIGHT) / channels;
+                float barWidth = static_cast<float>(WINDOW_WIDTH) / BAR_COUNT;
+                for (unsigned int channel = 0; channel < channels; ++channel) {
+                    float bottom = bandHeight * (channel + 1);
+                    for (int b = 0; b < BAR_COUNT; ++b) {
+                        float top = bottom - frame.bars[channel * BAR_COUNT + b] * (bandHeight - 4.0f);
+                        float left = b * barWidth, right = left + barWidth - 1.0f;
+                        sf::Vertex* quad = &bars[(channel * BAR_COUNT + b) * 4];
+                        quad[0] = sf::Vertex(sf::Vector2f(left, bottom), sf::Color::Green);
+                        quad[1] = sf::Vertex(sf::Vector2f(right, bottom), sf::Color::Green);
+                        quad[2] = sf::Vertex(sf::Vector2f(right, top), sf::Color::Cyan);
+                        quad[3] = sf::Vertex(sf::Vector2f(left, top), sf::Color::Cyan);
+                    }
+                }
             }
 
-            // Get the amplitude of the current sample.
-            // sf::Int16 samples are typically in the range of -32768 to +32767.
-            // We use the first channel if stereo.
-            float sampleValue = static_cast<float>(samples[sampleIndex * channels]);
+            if (mode == Overview) {
+                double perColumn = overviewFramesPerColumn > 0 ? overviewFramesPerColumn : wholeTrack;
+                double first = overviewFramesPerColumn > 0 ? overviewFirst : 0.0;
+                float bandHeight = static_cast<float>(WINDOW_HEIGHT) / channels;
+                std::size_t rmsStart = static_cast<std::size_t>(channels) * WINDOW_WIDTH * 2; // The RMS lines come second
+                for (unsigned int channel = 0; channel < channels; ++channel) {
+                    pyramid.columns(channel, first, perColumn, WINDOW_WIDTH, columnPeaks.data());
+                    float center = bandHeight * (channel + 0.5f), half = bandHeight / 2.0f - 2.0f;
+                    for (unsigned int x = 0; x < WINDOW_WIDTH; ++x) {
+                        const Peak& peak = columnPeaks[x];
+                        float rms = peak.rms() * half, column = static_cast<float>(x);
+                        std::size_t i = (static_cast<std::size_t>(channel) * WINDOW_WIDTH + x) * 2;
+                        overview[i] = sf::Vertex(sf::Vector2f(column, center - peak.max * half), sf::Color::Green);
+                        overview[i + 1] = sf::Vertex(sf::Vector2f(column, center - peak.min * half), sf::Color::Green);
+                        overview[rmsStart + i] = sf::Vertex(sf::Vector2f(column, center - rms), sf::Color::Cyan);
+                        overview[rmsStart + i + 1] = sf::Vertex(sf::Vector2f(column, center + rms), sf::Color::Cyan);
+                    }
+                }
+                float playhead = static_cast<float>((currentFrame - first) / perColumn);
+                std::size_t last = overview.getVertexCount() - 2;
+                overview[last] = sf::Vertex(sf::Vector2f(playhead, 0.0f), sf::Color::White);
+                overview[last + 1] = sf::Vertex(sf::Vector2f(playhead, static_cast<float>(WINDOW_HEIGHT)), sf::Color::White);
+            }
 
-            // Normalize the sample value to a range between -1 and 1.
-            // Dividing by 32768 (max positive value for Int16) is a common way.
-            float normalizedAmplitude = sampleValue / 32768.0f;
+            // Iterate through a limited number of samples to draw.
+            // This creates a scrolling effect. (The GPU needs none of this.)
+            waveform.clear();
+            for (int i = 0; i < frame.waveform_count && mode == Waveform && !useGpu; ++i) {
+                // Get the amplitude of the current sample.
+                // The analysis already has it normalized to a range between -1 and 1 (times
+                // the gain), and as the mix of all channels if stereo.
+                float normalizedAmplitude = frame.waveform[i];
 
-            // Calculate the y-coordinate for the waveform.
-            // The center of the screen is WINDOW_HEIGHT / 2.
-            // We multiply by AMPLITUDE_SCALE to make the waveform visible.
-            float yPos = WINDOW_HEIGHT / 2.0f - normalizedAmplitude * AMPLITUDE_SCALE;
+                // Calculate the y-coordinate for the waveform.
+                // The center of the screen is WINDOW_HEIGHT / 2.
+                // We multiply by AMPLITUDE_SCALE to make the waveform visible.
+                float yPos = WINDOW_HEIGHT / 2.0f - normalizedAmplitude * AMPLITUDE_SCALE;
 
-            // Define the x-coordinate for the current sample.
-            // This creates the horizontal progression of the waveform.
-            float xPos = static_cast<float>(i) * (static_cast<float>(WINDOW_WIDTH) / MAX_SAMPLES_TO_DISPLAY);
+                // Define the x-coordinate for the current sample.
+                // This creates the horizontal progression of the waveform.
+                float xPos = static_cast<float>(i) * (static_cast<float>(WINDOW_WIDTH) / MAX_SAMPLES_TO_DISPLAY);
 
-            // Set the vertices for the current line segment.
-            // Each line segment is defined by two points: a start and an end.
-            // For a waveform, we often draw vertical lines to represent amplitude at a point.
-            // Here, we're drawing a line from the center to the calculated yPos.
+                // Add the vertices for the current line segment.
+                // Each line segment is defined by two points: a start and an end.
+                // For a waveform, we often draw vertical lines to represent amplitude at a point.
+                // Here, we're drawing a line from the center to the calculated yPos.
 
-            // Vertex 1: The starting point of the line (on the center line)
-            waveform[i * 2].position = sf::Vector2f(xPos, WINDOW_HEIGHT / 2.0f);
-            waveform[i * 2].color = sf::Color::Green; // Set the color of the line
+                // Vertex 1: The starting point of the line (on the center line)
+                waveform.append(sf::Vertex(sf::Vector2f(xPos, WINDOW_HEIGHT / 2.0f), sf::Color::Green));
 
-            // Vertex 2: The ending point of the line (at the calculated amplitude)
-            waveform[i * 2 + 1].position = sf::Vector2f(xPos, yPos);
-            waveform[i * 2 + 1].color = sf::Color::Cyan; // Set the color of the line
+                // Vertex 2: The ending point of the line (at the calculated amplitude)
+                waveform.append(sf::Vertex(sf::Vector2f(xPos, yPos), sf::Color::Cyan));
+            }
         }
 
         // 8. Drawing
-        window.clear(sf::Color::Black); // Clear the window with a black background.
+        {
+            ScopedTimer timer(profiler[Draw]);
+            window.clear(sf::Color::Black); // Clear the window with a black background.
 
-        // Draw the waveform.
-        // This function renders all the vertices we've defined in the 'waveform' array.
-        window.draw(waveform);
+            // Draw the waveform (or the spectrum, or the overview).
+            // This function renders all the vertices we've defined in the 'waveform' array.
+            // The GPU's waveform ends where the CPU's does.
+            if (mode == Waveform && useGpu) {
+                sf::Int64 end = static_cast<sf::Int64>(currentFrame) + MAX_SAMPLES_TO_DISPLAY;
+                gpuWaveform.draw(window, end - GPU_WAVEFORM_FRAMES, shown, gain);
+            } else if (mode == SpectrogramMode) {
+                spectrogram.draw(window, spectrogramColumns);
+            } else {
+                window.draw(mode == Spectrum ? bars : mode == Overview ? overview : waveform);
+            }
+
+            // And on top of it all, where the time goes (see "Profiling").
+            if (profiling) profiler.draw(window, WINDOW_TITLE);
+        }
 
-        window.display(); // Update the window to show what we've drawn.
+        {
+            ScopedTimer timer(profiler[Display]);
+            window.display(); // Update the window to show what we've drawn.
+        }
     }
 
     return 0; // Indicate successful execution.
@@ -159,19 +2273,40 @@ int main() {
 // //////////////////////////////////////////////////////////////////////////////
 // // Example Usage:                                                           //
 // //                                                                          //
-// // 1. Save this code as a .cpp file (e.g., visualizer.cpp).                 //
+// // 1. Save this code as a .cpp file (e.g., visualizer.cpp), next to        //
+// //    frame_profiler.hpp, which it includes.                                //
 // // 2. Make sure you have an audio file (e.g., 'your_audio_file.ogg') in    //
-// //    the same directory. Replace "your_audio_file.ogg" in the code with   //
-// //    your actual audio file name.                                         //
+// //    the same directory, or pass its name on the command line.            //
 // // 3. Compile the code using a C++ compiler that has SFML configured.       //
 // //    Example using g++ (Linux/macOS):                                     //
-// //    g++ visualizer.cpp -o visualizer -lsfml-graphics -lsfml-window -lsfml-audio //
+// //    g++ -pthread visualizer.cpp -o visualizer -lsfml-graphics -lsfml-window -lsfml-audio -lsfml-system //
 // //    Example using MSVC (Windows):                                         //
 // //    (You'll need to set up SFML project properties in Visual Studio)      //
 // // 4. Run the executable:                                                   //
 // //    ./visualizer (Linux/macOS)                                           //
+// //    ./visualizer my_song.flac     (any file, however long)               //
+// //    ./visualizer --mic            (live input from the microphone)       //
+// //    ./visualizer --analyze *.flac (no window: writes the overview and    //
+// //                                  spectrogram of every file next to it) //
+// //    ./visualizer my_song.flac --latency 60  (if the waveform runs ahead  //
+// //                                  of the sound, e.g. on Bluetooth)       //
+// //    ./visualizer --bench-json > results.json  (no window: times the      //
+// //                                  kernels, for comparing versions)      //
 // //    visualizer.exe (Windows)                                             //
 // //                                                                          //
 // // You should see a window with a scrolling waveform. Press SPACE to play/pause. //
+// // Press UP/DOWN to make the waveform and the spectrum louder or quieter.   //
+// // Where the graphics card can, it draws the waveform of every channel,     //
+// // about 0.4 s of it; press G to switch to the CPU's short waveform.        //
+// // Press M to switch to the spectrum: one row of bars per channel, with low //
+// // frequencies on the left and high ones on the right. Press M again for   //
+// // the spectrogram, the last minutes of spectra scrolling to the left (the //
+// // mouse wheel shows more or fewer of them), and once more for             //
+// // the overview of the whole track (while it is being scanned, it fills in //
+// // from the left). Zoom with the mouse wheel, click to jump there, and M   //
+// // once more returns to the waveform. The scan is saved as "<file>.peaks", //
+// // so the next time the overview is there at once.                          //
+// // Press F3 to see where the time of each frame goes: a bar per stage, its //
+// // median and its slowest 1% (the numbers are in the title bar).          //
 // //                                                                          //
-// // //////////////////////////////////////////////////////////////////////////
\ No newline at end of file
+// // //////////////////////////////////////////////////////////////////////////
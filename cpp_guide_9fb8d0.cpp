@@ -4,17 +4,57 @@
 // 2. Mapping complex numbers to screen coordinates.
 // 3. Iterating a complex function to determine if a point belongs to the set.
 // 4. Using a basic graphics library (like SFML) to draw pixels and visualize the result.
+// 5. Spreading the work over all CPU cores with a tiled, work-stealing thread pool.
+// 6. Computing 4, 8 or 16 points at once with SIMD instructions, picked at runtime
+//    to match the CPU the program runs on.
+// 7. Drawing into our own pixel buffer and uploading it to the GPU in one go.
+// 8. Zooming and panning with the mouse, with a quick coarse preview that is refined
+//    pass by pass, and reusing what is already on screen when the view only moves.
+// 9. Recognizing points inside the set early, instead of iterating them to the limit.
+// 10. Zooming far deeper than a double allows, with perturbation theory.
+// 11. Computing the picture on the graphics card with a fragment shader.
+// 12. Smooth coloring without bands, with palettes looked up from a table.
+// 13. Rendering huge images and zoom animations to files, without a window.
+// 14. Measuring where the time of each frame goes, with a timer around every stage.
 // This example assumes you have SFML installed. For installation instructions, visit https://www.sfml-dev.org/download.php
 
 #include <SFML/Graphics.hpp> // Include the SFML graphics library for window and drawing
 #include <complex>           // Include the complex number library for complex arithmetic
+#include <vector>            // For the tile list and the buffer of iteration counts
+#include <thread>            // For std::thread, the workers of the thread pool
+#include <atomic>            // For the lock-free per-worker tile queues
+#include <mutex>             // For std::mutex, used to start and finish a batch of tiles
+#include <condition_variable> // For waking the workers when there is work
+#include <functional>        // For std::function, the job the workers run on each tile
+#include <chrono>            // For timing the benchmark
+#include <iostream>          // For printing the benchmark results
+#include <string>            // For reading command line arguments
+#include <cstdint>           // For uint64_t, which packs a tile range into one atomic
+#include <memory>            // For std::unique_ptr, which owns the tile queues
+#include <algorithm>         // For std::min
+#include <cstdlib>           // For getenv(), which can force a particular SIMD kernel
+#include <cmath>             // For std::lround, std::pow, std::floor and std::ldexp
+#include <cstring>           // For memmove(), which shifts the frame when panning
+#include <fstream>           // For writing images to disk in headless mode
+#include <stdexcept>         // For std::invalid_argument, for bad command line options
+#include "frame_profiler.hpp" // For the profiling overlay (F3), shared with the audio visualizer
+
+// The SIMD kernels use the vector instructions of the CPU directly ("intrinsics").
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>       // For the SSE/AVX2/AVX-512 intrinsics
+#define MANDELBROT_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>        // For the NEON intrinsics
+#define MANDELBROT_NEON 1
+#endif
 
 // Define the dimensions of our output window
 const int WIDTH = 800;
 const int HEIGHT = 800;
 
 // Define the region of the complex plane we want to visualize
-// This is the standard view of the Mandelbrot set
+// This is the standard view of the Mandelbrot set, which the program starts with
+// (and returns to when you press R)
 const double RE_START = -2.0;
 const double RE_END = 1.0;
 const double IM_START = -1.5;
@@ -24,106 +64,2339 @@ const double IM_END = 1.5;
 // Higher values result in more detail but take longer to compute
 const int MAX_ITERATIONS = 100;
 
+// The image is cut into square tiles of this many pixels per side. A tile is the
+// unit of work handed to a thread: big enough that handing it out costs nothing
+// compared to computing it, small enough that there are many more tiles than threads.
+const int TILE_SIZE = 32;
+
+// All kernels below must give exactly the same iteration counts, so every multiply
+// and add has to be rounded on its own. Compilers like to merge a * b + c into one
+// "fused multiply-add" instruction, which rounds only once and can change the count
+// of a point right on the edge of the set, so we turn that off for the kernels.
+#if defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+// Most of the time goes into the points inside the set: they never escape, so they run
+// all max_iterations. Two tricks recognize many of them early, without changing a
+// single count:
+//
+// 1. The two biggest parts of the set, the heart-shaped "main cardioid" and the
+//    circle left of it (the "period-2 bulb"), have simple formulas. A point inside
+//    either one is in the set, no iterating needed.
+// 2. Inside the set, z usually settles into a cycle. If z ever comes back to exactly
+//    the same value, it can only repeat the same values forever and will never
+//    escape. So we remember z now and then and compare the new z against it. The
+//    saved value is replaced at iterations 8, 16, 32, ... (Brent's method): the gap
+//    keeps doubling, so sooner or later it is longer than the cycle, however long the
+//    cycle is. Because we only stop on an exact match, the result is always the same
+//    as running to max_iterations.
+bool in_cardioid_or_bulb(double cr, double ci) {
+    double ci2 = ci * ci;
+    double xr = cr - 0.25;
+    double q = xr * xr + ci2;
+    if (q * (q + xr) <= 0.25 * ci2) return true; // Main cardioid
+    double xb = cr + 1.0;
+    return xb * xb + ci2 <= 0.0625;              // Period-2 bulb: |c + 1| <= 1/4
+}
+
+// The first iteration at which the orbit is saved for the cycle check; later checks
+// are at twice, four times, ... this.
+const int FIRST_CYCLE_CHECK = 8;
+
 // Function to calculate the Mandelbrot iteration for a given complex number
 // It returns the number of iterations before the magnitude exceeds 2 (diverges)
-// or MAX_ITERATIONS if it stays bounded.
-int mandelbrot(std::complex<double> c) {
-    std::complex<double> z = 0; // Initialize z to 0 for each point
-    int iterations = 0;         // Initialize iteration count
+// or 'max_iterations' if it stays bounded.
+//
+// |z| < 2 is the same as |z|^2 < 4, and |z|^2 = re^2 + im^2 needs no square root.
+// Better still, re^2 and im^2 are exactly the two squares z * z needs anyway:
+// (re + i*im)^2 = re^2 - im^2 + i*(2*re*im). So we split z into its real and
+// imaginary parts instead of using std::complex, and the escape test becomes free.
+//
+// If 'escaped_z' isn't null, it receives the first z with |z| >= 2, for smooth_count().
+int mandelbrot(std::complex<double> c, int max_iterations = MAX_ITERATIONS,
+               std::complex<double>* escaped_z = nullptr) {
+    double cr = c.real(), ci = c.imag();
+    if (in_cardioid_or_bulb(cr, ci)) return max_iterations;
+    double zr = 0.0, zi = 0.0; // Initialize z to 0 for each point
+    int iterations = 0;        // Initialize iteration count
+    double saved_r = 0.0, saved_i = 0.0; // An earlier z, for the cycle check
+    int next_save = FIRST_CYCLE_CHECK;
 
     // The core of the Mandelbrot algorithm: z = z*z + c
-    // We repeat this process up to MAX_ITERATIONS times.
-    while (std::abs(z) < 2.0 && iterations < MAX_ITERATIONS) {
-        z = z * z + c;      // This is the Mandelbrot iteration formula
-        iterations++;       // Increment the iteration counter
+    // We repeat this process up to max_iterations times.
+    while (iterations < max_iterations) {
+        double zr2 = zr * zr;
+        double zi2 = zi * zi;
+        if (zr2 + zi2 >= 4.0) break; // |z| >= 2: the point escapes
+        double zri = zr * zi;
+        zi = (zri + zri) + ci;       // Imaginary part of z*z + c
+        zr = (zr2 - zi2) + cr;       // Real part of z*z + c
+        iterations++;                // Increment the iteration counter
+        if (zr == saved_r && zi == saved_i) return max_iterations; // A cycle: z never escapes
+        if (iterations == next_save) {
+            saved_r = zr;
+            saved_i = zi;
+            next_save *= 2;
+        }
     }
+    if (escaped_z != nullptr) *escaped_z = std::complex<double>(zr, zi);
     return iterations;      // Return the number of iterations
 }
 
-int main() {
-    // Create an SFML window
-    sf::RenderWindow window(sf::VideoMode(WIDTH, HEIGHT), "Mandelbrot Set");
+// log2(x) for x >= 1, to about 4 digits, which is plenty for picking a color and
+// several times faster than std::log2. A double is stored as m * 2^e with m in [1, 2),
+// so log2(x) = e + log2(m), and a polynomial that is exact at m = 1 and m = 2 covers
+// log2(m) without any jumps.
+__attribute__((always_inline)) inline double fast_log2(double x) {
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof bits);
+    int e = static_cast<int>((bits >> 52) & 0x7ff) - 1023;
+    bits = (bits & 0x000fffffffffffffull) | 0x3ff0000000000000ull; // The same m, with e = 0.
+    double m;
+    memcpy(&m, &bits, sizeof m);
+    double t = m - 1.0;
+    return e + t * (1.4380732454003358 + t * (-0.6747666626374909 + t * (0.3170007210977666 + t * -0.08030730386061152)));
+}
+
+// The iteration count is a whole number, so the colors change in steps ("bands").
+// The "normalized iteration count" fills in the fraction: how far past 2 the point
+// escaped tells how close it came to escaping one iteration earlier. Since |z|
+// roughly squares every iteration, log2(log2 |z|) grows by 1 per iteration, and
+// n + 1 - log2(log2 |z_n|) changes smoothly from pixel to pixel. A few extra
+// iterations first make |z| large, which makes the result even smoother.
+__attribute__((always_inline)) inline float smooth_count(int n, int max_iterations, double zr, double zi, double cr,
+                                                          double ci) {
+    if (n >= max_iterations) return static_cast<float>(max_iterations);
+    const int extra = 3;
+    for (int k = 0; k < extra; ++k) {
+        double zri = zr * zi;
+        zr = (zr * zr - zi * zi) + cr;
+        zi = (zri + zri) + ci;
+    }
+    double log2_z = 0.5 * fast_log2(zr * zr + zi * zi);
+    double mu = n + extra + 1 - fast_log2(log2_z);
+    return static_cast<float>(std::min(std::max(mu, 0.0), static_cast<double>(max_iterations)));
+}
 
-    // Create an SFML Image object to store the pixel data
-    sf::Image image;
-    image.create(WIDTH, HEIGHT); // Create the image with our defined dimensions
+// smooth_count() for a group of points from a SIMD kernel.
+// (Always inlined, see "How the SIMD kernels work" below.)
+__attribute__((always_inline)) inline void smooth_counts(const double* cr, const double* ci, const double* zr,
+                                                         const double* zi, const int* n, int count,
+                                                         int max_iterations, float* smooth) {
+    for (int i = 0; i < count; ++i) smooth[i] = smooth_count(n[i], max_iterations, zr[i], zi[i], cr[i], ci[i]);
+}
 
-    // Iterate over each pixel in the window
-    for (int x = 0; x < WIDTH; ++x) {
-        for (int y = 0; y < HEIGHT; ++y) {
-            // Map the pixel coordinates (x, y) to a point in the complex plane
-            // This is a linear transformation:
-            // real part: scales x from [0, WIDTH] to [RE_START, RE_END]
-            double re = RE_START + (double)x / WIDTH * (RE_END - RE_START);
-            // imaginary part: scales y from [0, HEIGHT] to [IM_START, IM_END]
-            // We invert y because screen coordinates usually have (0,0) at the top-left,
-            // while the complex plane has the imaginary axis increasing upwards.
-            double im = IM_START + (double)y / HEIGHT * (IM_END - IM_START);
-
-            // Create a complex number from the mapped real and imaginary parts
-            std::complex<double> c(re, im);
-
-            // Calculate the number of iterations for this complex number
-            int iterations = mandelbrot(c);
-
-            // Determine the color of the pixel based on the iteration count
-            // If iterations == MAX_ITERATIONS, the point is likely in the Mandelbrot set (black)
-            // Otherwise, we use the iteration count to create a gradient for the points outside the set.
-            sf::Color color;
-            if (iterations == MAX_ITERATIONS) {
-                color = sf::Color::Black; // Points inside the set are black
+// The same loop without the two tricks above, to measure what they save.
+int mandelbrot_brute_force(std::complex<double> c, int max_iterations = MAX_ITERATIONS) {
+    double cr = c.real(), ci = c.imag();
+    double zr = 0.0, zi = 0.0;
+    int iterations = 0;
+    while (iterations < max_iterations) {
+        double zr2 = zr * zr;
+        double zi2 = zi * zi;
+        if (zr2 + zi2 >= 4.0) break;
+        double zri = zr * zi;
+        zi = (zri + zri) + ci;
+        zr = (zr2 - zi2) + cr;
+        iterations++;
+    }
+    return iterations;
+}
+
+// The plain C++ kernel: one point after the other. Every SIMD version below does the
+// very same arithmetic on several points at once.
+void kernel_scalar(const double* cr, const double* ci, int count, int max_iterations, int* out, float* smooth) {
+    for (int i = 0; i < count; ++i) {
+        std::complex<double> z;
+        out[i] = mandelbrot(std::complex<double>(cr[i], ci[i]), max_iterations, &z);
+        if (smooth != nullptr) smooth[i] = smooth_count(out[i], max_iterations, z.real(), z.imag(), cr[i], ci[i]);
+    }
+}
+
+void kernel_brute_force(const double* cr, const double* ci, int count, int max_iterations, int* out, float* smooth) {
+    for (int i = 0; i < count; ++i) {
+        out[i] = mandelbrot_brute_force(std::complex<double>(cr[i], ci[i]), max_iterations);
+        if (smooth != nullptr) smooth[i] = static_cast<float>(out[i]);
+    }
+}
+
+// How the SIMD kernels work:
+// A vector register holds several doubles ("lanes"), one point per lane, and each
+// instruction works on all lanes at once. All points of a group run the loop together,
+// but a point that has escaped must stop counting. So every iteration computes a mask
+// that is all ones for lanes still inside |z| < 2, and adds 1 to a lane's count only
+// where its mask is set. The group is finished when no lane is left inside. The z of a
+// lane is only updated where the mask is set, too, so it stays at the first z outside,
+// which smooth_count() needs.
+// Each kernel keeps two independent groups in flight: a multiply takes several cycles
+// before its result can be used, and the second group fills those cycles.
+// The early-outs of mandelbrot() become a second mask, 'done': lanes that are in the
+// cardioid or bulb from the start, or whose z came back to the saved value. Done lanes
+// stop counting like escaped ones, and their count is set to max_iterations at the end.
+// (The z of an escaped lane no longer changes, so it would "match" once it has been
+// saved: a match only counts for lanes that are still inside.)
+// Plain C++ code is compiled to the older SSE instructions, and while the upper halves
+// of the AVX registers hold data, many CPUs run SSE instructions several times slower.
+// So smooth_counts() is always inlined into the kernels, which compiles it to AVX
+// instructions as well, and the AVX2 kernel calls _mm256_zeroupper() before it hands
+// the last few points to the scalar kernel.
+
+#if MANDELBROT_X86
+// in_cardioid_or_bulb() for 4 points at once, as a mask.
+__attribute__((target("avx2")))
+__m256d cardioid_or_bulb_avx2(__m256d cr, __m256d ci) {
+    __m256d ci2 = _mm256_mul_pd(ci, ci);
+    __m256d xr = _mm256_sub_pd(cr, _mm256_set1_pd(0.25));
+    __m256d q = _mm256_add_pd(_mm256_mul_pd(xr, xr), ci2);
+    __m256d cardioid = _mm256_cmp_pd(_mm256_mul_pd(q, _mm256_add_pd(q, xr)),
+                                     _mm256_mul_pd(_mm256_set1_pd(0.25), ci2), _CMP_LE_OQ);
+    __m256d xb = _mm256_add_pd(cr, _mm256_set1_pd(1.0));
+    __m256d bulb = _mm256_cmp_pd(_mm256_add_pd(_mm256_mul_pd(xb, xb), ci2), _mm256_set1_pd(0.0625), _CMP_LE_OQ);
+    return _mm256_or_pd(cardioid, bulb);
+}
+
+// AVX2: 4 doubles per register, two registers, so 8 points per group.
+__attribute__((target("avx2")))
+void kernel_avx2(const double* cr, const double* ci, int count, int max_iterations, int* out, float* smooth) {
+    const __m256d four = _mm256_set1_pd(4.0);
+    const __m256d one = _mm256_set1_pd(1.0);
+    const __m256d max_n = _mm256_set1_pd(max_iterations);
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256d cr0 = _mm256_loadu_pd(cr + i), cr1 = _mm256_loadu_pd(cr + i + 4);
+        __m256d ci0 = _mm256_loadu_pd(ci + i), ci1 = _mm256_loadu_pd(ci + i + 4);
+        __m256d zr0 = _mm256_setzero_pd(), zi0 = _mm256_setzero_pd(), n0 = _mm256_setzero_pd();
+        __m256d zr1 = _mm256_setzero_pd(), zi1 = _mm256_setzero_pd(), n1 = _mm256_setzero_pd();
+        __m256d sr0 = zr0, si0 = zi0, sr1 = zr1, si1 = zi1; // Saved z, for the cycle check
+        __m256d done0 = cardioid_or_bulb_avx2(cr0, ci0), done1 = cardioid_or_bulb_avx2(cr1, ci1);
+        int next_save = FIRST_CYCLE_CHECK;
+        for (int k = 0; k < max_iterations; ++k) {
+            __m256d zr2_0 = _mm256_mul_pd(zr0, zr0), zi2_0 = _mm256_mul_pd(zi0, zi0);
+            __m256d zr2_1 = _mm256_mul_pd(zr1, zr1), zi2_1 = _mm256_mul_pd(zi1, zi1);
+            __m256d inside0 = _mm256_andnot_pd(done0, _mm256_cmp_pd(_mm256_add_pd(zr2_0, zi2_0), four, _CMP_LT_OQ));
+            __m256d inside1 = _mm256_andnot_pd(done1, _mm256_cmp_pd(_mm256_add_pd(zr2_1, zi2_1), four, _CMP_LT_OQ));
+            if (_mm256_movemask_pd(_mm256_or_pd(inside0, inside1)) == 0) break;
+            n0 = _mm256_add_pd(n0, _mm256_and_pd(inside0, one));
+            n1 = _mm256_add_pd(n1, _mm256_and_pd(inside1, one));
+            __m256d zri0 = _mm256_mul_pd(zr0, zi0), zri1 = _mm256_mul_pd(zr1, zi1);
+            zi0 = _mm256_blendv_pd(zi0, _mm256_add_pd(_mm256_add_pd(zri0, zri0), ci0), inside0);
+            zi1 = _mm256_blendv_pd(zi1, _mm256_add_pd(_mm256_add_pd(zri1, zri1), ci1), inside1);
+            zr0 = _mm256_blendv_pd(zr0, _mm256_add_pd(_mm256_sub_pd(zr2_0, zi2_0), cr0), inside0);
+            zr1 = _mm256_blendv_pd(zr1, _mm256_add_pd(_mm256_sub_pd(zr2_1, zi2_1), cr1), inside1);
+            __m256d cycle0 = _mm256_and_pd(_mm256_cmp_pd(zr0, sr0, _CMP_EQ_OQ), _mm256_cmp_pd(zi0, si0, _CMP_EQ_OQ));
+            __m256d cycle1 = _mm256_and_pd(_mm256_cmp_pd(zr1, sr1, _CMP_EQ_OQ), _mm256_cmp_pd(zi1, si1, _CMP_EQ_OQ));
+            done0 = _mm256_or_pd(done0, _mm256_and_pd(cycle0, inside0));
+            done1 = _mm256_or_pd(done1, _mm256_and_pd(cycle1, inside1));
+            if (k + 1 == next_save) {
+                sr0 = zr0, si0 = zi0, sr1 = zr1, si1 = zi1;
+                next_save *= 2;
+            }
+        }
+        n0 = _mm256_blendv_pd(n0, max_n, done0);
+        n1 = _mm256_blendv_pd(n1, max_n, done1);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm256_cvttpd_epi32(n0));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 4), _mm256_cvttpd_epi32(n1));
+        if (smooth != nullptr) {
+            alignas(32) double zr[8], zi[8];
+            _mm256_store_pd(zr, zr0), _mm256_store_pd(zr + 4, zr1);
+            _mm256_store_pd(zi, zi0), _mm256_store_pd(zi + 4, zi1);
+            smooth_counts(cr + i, ci + i, zr, zi, out + i, 8, max_iterations, smooth + i);
+        }
+    }
+    // The last few points.
+    _mm256_zeroupper();
+    kernel_scalar(cr + i, ci + i, count - i, max_iterations, out + i, smooth != nullptr ? smooth + i : nullptr);
+}
+
+// in_cardioid_or_bulb() for 8 points at once, as a mask register.
+__attribute__((target("avx512f")))
+__mmask8 cardioid_or_bulb_avx512(__m512d cr, __m512d ci) {
+    __m512d ci2 = _mm512_mul_pd(ci, ci);
+    __m512d xr = _mm512_sub_pd(cr, _mm512_set1_pd(0.25));
+    __m512d q = _mm512_add_pd(_mm512_mul_pd(xr, xr), ci2);
+    __mmask8 cardioid = _mm512_cmp_pd_mask(_mm512_mul_pd(q, _mm512_add_pd(q, xr)),
+                                           _mm512_mul_pd(_mm512_set1_pd(0.25), ci2), _CMP_LE_OQ);
+    __m512d xb = _mm512_add_pd(cr, _mm512_set1_pd(1.0));
+    __mmask8 bulb = _mm512_cmp_pd_mask(_mm512_add_pd(_mm512_mul_pd(xb, xb), ci2), _mm512_set1_pd(0.0625), _CMP_LE_OQ);
+    return cardioid | bulb;
+}
+
+// AVX-512: 8 doubles per register, two registers, so 16 points per group. AVX-512 has
+// real mask registers, so "add 1 where inside" is a single masked add.
+__attribute__((target("avx512f")))
+void kernel_avx512(const double* cr, const double* ci, int count, int max_iterations, int* out, float* smooth) {
+    const __m512d four = _mm512_set1_pd(4.0);
+    const __m512d one = _mm512_set1_pd(1.0);
+    const __m512d max_n = _mm512_set1_pd(max_iterations);
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m512d cr0 = _mm512_loadu_pd(cr + i), cr1 = _mm512_loadu_pd(cr + i + 8);
+        __m512d ci0 = _mm512_loadu_pd(ci + i), ci1 = _mm512_loadu_pd(ci + i + 8);
+        __m512d zr0 = _mm512_setzero_pd(), zi0 = _mm512_setzero_pd(), n0 = _mm512_setzero_pd();
+        __m512d zr1 = _mm512_setzero_pd(), zi1 = _mm512_setzero_pd(), n1 = _mm512_setzero_pd();
+        __m512d sr0 = zr0, si0 = zi0, sr1 = zr1, si1 = zi1;
+        __mmask8 done0 = cardioid_or_bulb_avx512(cr0, ci0), done1 = cardioid_or_bulb_avx512(cr1, ci1);
+        int next_save = FIRST_CYCLE_CHECK;
+        for (int k = 0; k < max_iterations; ++k) {
+            __m512d zr2_0 = _mm512_mul_pd(zr0, zr0), zi2_0 = _mm512_mul_pd(zi0, zi0);
+            __m512d zr2_1 = _mm512_mul_pd(zr1, zr1), zi2_1 = _mm512_mul_pd(zi1, zi1);
+            __mmask8 inside0 = _mm512_mask_cmp_pd_mask(~done0, _mm512_add_pd(zr2_0, zi2_0), four, _CMP_LT_OQ);
+            __mmask8 inside1 = _mm512_mask_cmp_pd_mask(~done1, _mm512_add_pd(zr2_1, zi2_1), four, _CMP_LT_OQ);
+            if ((inside0 | inside1) == 0) break;
+            n0 = _mm512_mask_add_pd(n0, inside0, n0, one);
+            n1 = _mm512_mask_add_pd(n1, inside1, n1, one);
+            __m512d zri0 = _mm512_mul_pd(zr0, zi0), zri1 = _mm512_mul_pd(zr1, zi1);
+            zi0 = _mm512_mask_add_pd(zi0, inside0, _mm512_add_pd(zri0, zri0), ci0);
+            zi1 = _mm512_mask_add_pd(zi1, inside1, _mm512_add_pd(zri1, zri1), ci1);
+            zr0 = _mm512_mask_add_pd(zr0, inside0, _mm512_sub_pd(zr2_0, zi2_0), cr0);
+            zr1 = _mm512_mask_add_pd(zr1, inside1, _mm512_sub_pd(zr2_1, zi2_1), cr1);
+            done0 |= _mm512_mask_cmp_pd_mask(inside0 & _mm512_cmp_pd_mask(zi0, si0, _CMP_EQ_OQ), zr0, sr0, _CMP_EQ_OQ);
+            done1 |= _mm512_mask_cmp_pd_mask(inside1 & _mm512_cmp_pd_mask(zi1, si1, _CMP_EQ_OQ), zr1, sr1, _CMP_EQ_OQ);
+            if (k + 1 == next_save) {
+                sr0 = zr0, si0 = zi0, sr1 = zr1, si1 = zi1;
+                next_save *= 2;
+            }
+        }
+        n0 = _mm512_mask_blend_pd(done0, n0, max_n);
+        n1 = _mm512_mask_blend_pd(done1, n1, max_n);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm512_maskz_cvttpd_epi32(0xff, n0));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i + 8), _mm512_maskz_cvttpd_epi32(0xff, n1));
+        if (smooth != nullptr) {
+            alignas(64) double zr[16], zi[16];
+            _mm512_store_pd(zr, zr0), _mm512_store_pd(zr + 8, zr1);
+            _mm512_store_pd(zi, zi0), _mm512_store_pd(zi + 8, zi1);
+            smooth_counts(cr + i, ci + i, zr, zi, out + i, 16, max_iterations, smooth + i);
+        }
+    }
+    // Every AVX-512 CPU has AVX2.
+    kernel_avx2(cr + i, ci + i, count - i, max_iterations, out + i, smooth != nullptr ? smooth + i : nullptr);
+}
+#endif
+
+#if MANDELBROT_NEON
+// in_cardioid_or_bulb() for 2 points at once, as a mask.
+uint64x2_t cardioid_or_bulb_neon(float64x2_t cr, float64x2_t ci) {
+    float64x2_t ci2 = vmulq_f64(ci, ci);
+    float64x2_t xr = vsubq_f64(cr, vdupq_n_f64(0.25));
+    float64x2_t q = vaddq_f64(vmulq_f64(xr, xr), ci2);
+    uint64x2_t cardioid = vcleq_f64(vmulq_f64(q, vaddq_f64(q, xr)), vmulq_f64(vdupq_n_f64(0.25), ci2));
+    float64x2_t xb = vaddq_f64(cr, vdupq_n_f64(1.0));
+    uint64x2_t bulb = vcleq_f64(vaddq_f64(vmulq_f64(xb, xb), ci2), vdupq_n_f64(0.0625));
+    return vorrq_u64(cardioid, bulb);
+}
+
+// NEON: 2 doubles per register, two registers, so 4 points per group. A comparison
+// gives all ones (-1 as an integer) in the lanes where it holds, so subtracting the
+// mask adds 1 to exactly those lanes.
+void kernel_neon(const double* cr, const double* ci, int count, int max_iterations, int* out, float* smooth) {
+    const float64x2_t four = vdupq_n_f64(4.0);
+    const uint64x2_t max_n = vdupq_n_u64(static_cast<uint64_t>(max_iterations));
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        float64x2_t cr0 = vld1q_f64(cr + i), cr1 = vld1q_f64(cr + i + 2);
+        float64x2_t ci0 = vld1q_f64(ci + i), ci1 = vld1q_f64(ci + i + 2);
+        float64x2_t zr0 = vdupq_n_f64(0.0), zi0 = vdupq_n_f64(0.0);
+        float64x2_t zr1 = vdupq_n_f64(0.0), zi1 = vdupq_n_f64(0.0);
+        float64x2_t sr0 = zr0, si0 = zi0, sr1 = zr1, si1 = zi1;
+        uint64x2_t n0 = vdupq_n_u64(0), n1 = vdupq_n_u64(0);
+        uint64x2_t done0 = cardioid_or_bulb_neon(cr0, ci0), done1 = cardioid_or_bulb_neon(cr1, ci1);
+        int next_save = FIRST_CYCLE_CHECK;
+        for (int k = 0; k < max_iterations; ++k) {
+            float64x2_t zr2_0 = vmulq_f64(zr0, zr0), zi2_0 = vmulq_f64(zi0, zi0);
+            float64x2_t zr2_1 = vmulq_f64(zr1, zr1), zi2_1 = vmulq_f64(zi1, zi1);
+            uint64x2_t inside0 = vbicq_u64(vcltq_f64(vaddq_f64(zr2_0, zi2_0), four), done0);
+            uint64x2_t inside1 = vbicq_u64(vcltq_f64(vaddq_f64(zr2_1, zi2_1), four), done1);
+            if (vmaxvq_u32(vreinterpretq_u32_u64(vorrq_u64(inside0, inside1))) == 0) break;
+            n0 = vsubq_u64(n0, inside0);
+            n1 = vsubq_u64(n1, inside1);
+            float64x2_t zri0 = vmulq_f64(zr0, zi0), zri1 = vmulq_f64(zr1, zi1);
+            zi0 = vbslq_f64(inside0, vaddq_f64(vaddq_f64(zri0, zri0), ci0), zi0);
+            zi1 = vbslq_f64(inside1, vaddq_f64(vaddq_f64(zri1, zri1), ci1), zi1);
+            zr0 = vbslq_f64(inside0, vaddq_f64(vsubq_f64(zr2_0, zi2_0), cr0), zr0);
+            zr1 = vbslq_f64(inside1, vaddq_f64(vsubq_f64(zr2_1, zi2_1), cr1), zr1);
+            uint64x2_t cycle0 = vandq_u64(vceqq_f64(zr0, sr0), vceqq_f64(zi0, si0));
+            uint64x2_t cycle1 = vandq_u64(vceqq_f64(zr1, sr1), vceqq_f64(zi1, si1));
+            done0 = vorrq_u64(done0, vandq_u64(cycle0, inside0));
+            done1 = vorrq_u64(done1, vandq_u64(cycle1, inside1));
+            if (k + 1 == next_save) {
+                sr0 = zr0, si0 = zi0, sr1 = zr1, si1 = zi1;
+                next_save *= 2;
+            }
+        }
+        n0 = vbslq_u64(done0, max_n, n0);
+        n1 = vbslq_u64(done1, max_n, n1);
+        out[i] = static_cast<int>(vgetq_lane_u64(n0, 0));
+        out[i + 1] = static_cast<int>(vgetq_lane_u64(n0, 1));
+        out[i + 2] = static_cast<int>(vgetq_lane_u64(n1, 0));
+        out[i + 3] = static_cast<int>(vgetq_lane_u64(n1, 1));
+        if (smooth != nullptr) {
+            double zr[4], zi[4];
+            vst1q_f64(zr, zr0), vst1q_f64(zr + 2, zr1);
+            vst1q_f64(zi, zi0), vst1q_f64(zi + 2, zi1);
+            smooth_counts(cr + i, ci + i, zr, zi, out + i, 4, max_iterations, smooth + i);
+        }
+    }
+    kernel_scalar(cr + i, ci + i, count - i, max_iterations, out + i, smooth != nullptr ? smooth + i : nullptr);
+}
+#endif
+
+// A kernel computes the iteration counts of 'count' points c = cr[i] + i*ci[i], and,
+// unless 'smooth' is null, their smooth_count() for coloring.
+typedef void (*KernelFunction)(const double* cr, const double* ci, int count, int max_iterations, int* out,
+                               float* smooth);
+
+struct Kernel {
+    const char* name;
+    KernelFunction function;
+    int points_per_group; // How many points one pass of the inner loop handles.
+};
+
+// Every kernel this build contains, best last; the scalar one runs everywhere.
+std::vector<Kernel> compiled_kernels() {
+    std::vector<Kernel> kernels = {{"scalar", kernel_scalar, 1}};
+#if MANDELBROT_X86
+    kernels.push_back({"avx2", kernel_avx2, 8});
+    kernels.push_back({"avx512", kernel_avx512, 16});
+#endif
+#if MANDELBROT_NEON
+    kernels.push_back({"neon", kernel_neon, 4});
+#endif
+    return kernels;
+}
+
+// Whether this CPU can run the kernel. The AVX kernels are compiled in regardless of
+// compiler flags, so we must ask the CPU before calling them.
+bool kernel_supported(const Kernel& kernel) {
+#if MANDELBROT_X86
+    __builtin_cpu_init();
+    if (std::string(kernel.name) == "avx2") return __builtin_cpu_supports("avx2");
+    if (std::string(kernel.name) == "avx512") return __builtin_cpu_supports("avx512f");
+#endif
+    (void)kernel;
+    return true; // The scalar kernel, and NEON, which every 64-bit ARM CPU has.
+}
+
+// Picks the kernel for this CPU ("runtime dispatch"): the best supported one, unless
+// the environment variable MANDELBROT_KERNEL names another (e.g. "scalar").
+const Kernel& active_kernel() {
+    static const Kernel chosen = [] {
+        std::vector<Kernel> kernels = compiled_kernels();
+        const char* wanted = getenv("MANDELBROT_KERNEL");
+        Kernel best = kernels.front();
+        for (const Kernel& k : kernels) {
+            if (!kernel_supported(k)) continue;
+            if (wanted != nullptr && std::string(wanted) == k.name) return k;
+            best = k;
+        }
+        return best;
+    }();
+    return chosen;
+}
+
+// A double has 53 bits of precision, so two points closer together than about 1e-16
+// times their size are the same double. Zoomed in that far, neighbouring pixels land
+// on the same point. To zoom deeper, the position of the view is kept as a fixed-point
+// number with FIXED_LIMBS 32-bit digits ("limbs"): one for the integer part and the
+// rest for the fraction, 224 bits or about 67 decimal places. The bits are stored in
+// two's complement like a (very wide) int, limb 0 being the least significant.
+// It is slow compared to a double, so only the few numbers that need it use it.
+const int FIXED_LIMBS = 8;
+
+class Fixed {
+public:
+    Fixed() : limbs_() {}
+
+    // Converts a double (|d| < 2^31). Every bit of it fits, so this is exact.
+    explicit Fixed(double d) : limbs_() {
+        double m = std::fabs(d);
+        double whole = std::floor(m);
+        limbs_[FIXED_LIMBS - 1] = static_cast<uint32_t>(whole);
+        m -= whole;
+        for (int i = FIXED_LIMBS - 2; i >= 0 && m > 0; --i) {
+            m *= 4294967296.0; // 2^32: move the next 32 bits in front of the point.
+            whole = std::floor(m);
+            limbs_[i] = static_cast<uint32_t>(whole);
+            m -= whole;
+        }
+        if (d < 0) *this = -*this;
+    }
+
+    // The nearest double (give or take the last bit).
+    double to_double() const {
+        if (negative()) return -(-*this).to_double();
+        double d = 0;
+        for (int i = 0; i < FIXED_LIMBS; ++i) {
+            d += std::ldexp(static_cast<double>(limbs_[i]), 32 * (i - (FIXED_LIMBS - 1)));
+        }
+        return d;
+    }
+
+    bool negative() const { return (limbs_[FIXED_LIMBS - 1] & 0x80000000u) != 0; }
+
+    Fixed operator-() const {
+        Fixed r;
+        uint64_t carry = 1; // Two's complement: invert all bits and add one.
+        for (int i = 0; i < FIXED_LIMBS; ++i) {
+            uint64_t t = static_cast<uint64_t>(~limbs_[i]) + carry;
+            r.limbs_[i] = static_cast<uint32_t>(t);
+            carry = t >> 32;
+        }
+        return r;
+    }
+
+    Fixed operator+(const Fixed& other) const {
+        Fixed r;
+        uint64_t carry = 0;
+        for (int i = 0; i < FIXED_LIMBS; ++i) {
+            uint64_t t = static_cast<uint64_t>(limbs_[i]) + other.limbs_[i] + carry;
+            r.limbs_[i] = static_cast<uint32_t>(t);
+            carry = t >> 32;
+        }
+        return r;
+    }
+
+    Fixed operator-(const Fixed& other) const { return *this + -other; }
+
+    // Long multiplication, like on paper but with digits of 32 bits. The product has
+    // twice as many fraction bits, so we keep the limbs from FIXED_LIMBS - 1 up.
+    Fixed operator*(const Fixed& other) const {
+        bool flip = negative() != other.negative();
+        Fixed a = negative() ? -*this : *this;
+        Fixed b = other.negative() ? -other : other;
+        uint32_t product[2 * FIXED_LIMBS] = {};
+        for (int i = 0; i < FIXED_LIMBS; ++i) {
+            uint64_t carry = 0;
+            for (int j = 0; j < FIXED_LIMBS; ++j) {
+                uint64_t t = static_cast<uint64_t>(a.limbs_[i]) * b.limbs_[j] + product[i + j] + carry;
+                product[i + j] = static_cast<uint32_t>(t);
+                carry = t >> 32;
+            }
+            product[i + FIXED_LIMBS] = static_cast<uint32_t>(carry);
+        }
+        Fixed r;
+        for (int i = 0; i < FIXED_LIMBS; ++i) r.limbs_[i] = product[i + FIXED_LIMBS - 1];
+        return flip ? -r : r;
+    }
+
+    bool operator==(const Fixed& other) const {
+        return std::equal(limbs_, limbs_ + FIXED_LIMBS, other.limbs_);
+    }
+
+private:
+    uint32_t limbs_[FIXED_LIMBS];
+};
+
+// The part of the complex plane on screen. Pixels are square, so the view is just
+// the point at the top-left pixel and the size of one pixel.
+struct View {
+    double re_start = RE_START;
+    double im_start = IM_START;
+    double scale = (RE_END - RE_START) / WIDTH; // Complex units per pixel.
+    // The top-left point again, exactly. The doubles above are rounded copies of it,
+    // good enough until the view is deep() (see the deep zoom section below).
+    Fixed re_exact = Fixed(RE_START);
+    Fixed im_exact = Fixed(IM_START);
+
+    // Map the pixel coordinates (x, y) to a point in the complex plane
+    // This is a linear transformation:
+    // real part: scales x from [0, WIDTH] to [RE_START, RE_END]
+    // imaginary part: scales y from [0, HEIGHT] to [IM_START, IM_END]
+    // Note that the imaginary part grows downwards here, like screen coordinates,
+    // which simply shows the (symmetric) set upside down.
+    std::complex<double> at(int x, int y) const {
+        return std::complex<double>(re_start + x * scale, im_start + y * scale);
+    }
+
+    // Zooms by 'factor' (below 1 zooms in) around the pixel (x, y), which stays put.
+    View zoomed(double factor, int x, int y) const {
+        View v;
+        v.scale = scale * factor;
+        v.moved_from(*this, x * (scale - v.scale), y * (scale - v.scale));
+        return v;
+    }
+
+    // Moves the picture 'dx' pixels right and 'dy' pixels down.
+    View panned(int dx, int dy) const {
+        View v = *this;
+        v.moved_from(*this, -dx * scale, -dy * scale);
+        return v;
+    }
+
+    // Places the top-left point at that of 'from' plus (re, im). The offsets are
+    // about the size of a pixel or a screen, so as doubles they are precise enough.
+    void moved_from(const View& from, double re, double im) {
+        re_exact = from.re_exact + Fixed(re);
+        im_exact = from.im_exact + Fixed(im);
+        re_start = re_exact.to_double();
+        im_start = im_exact.to_double();
+    }
+
+    bool operator==(const View& other) const {
+        return re_exact == other.re_exact && im_exact == other.im_exact && scale == other.scale;
+    }
+    bool operator!=(const View& other) const { return !(*this == other); }
+};
+
+// The view of a width x height picture centered on (re, im) with pixels of size 'scale'.
+View centered_view(const Fixed& re, const Fixed& im, double scale, int width, int height) {
+    View center;
+    center.re_exact = re;
+    center.im_exact = im;
+    View view;
+    view.scale = scale;
+    view.moved_from(center, -0.5 * width * scale, -0.5 * height * scale);
+    return view;
+}
+
+// If 'to' shows the same picture as 'from', just shifted by whole pixels, returns true
+// and sets (dx, dy) to that shift.
+bool pixel_shift_between(const View& from, const View& to, int& dx, int& dy) {
+    if (from.scale != to.scale) return false;
+    double fx = (from.re_exact - to.re_exact).to_double() / from.scale;
+    double fy = (from.im_exact - to.im_exact).to_double() / from.scale;
+    if (std::abs(fx) > 1e9 || std::abs(fy) > 1e9) return false;
+    dx = static_cast<int>(std::lround(fx));
+    dy = static_cast<int>(std::lround(fy));
+    return std::abs(fx - dx) < 1e-3 && std::abs(fy - dy) < 1e-3;
+}
+
+// (The mapping above is part of the no-fused-multiply-add region too, so every
+// kernel sees exactly the same points.)
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC pop_options
+#endif
+
+// Deep zoom.
+//
+// Once a pixel is smaller than DEEP_ZOOM_SCALE, doubles can no longer tell the pixels
+// apart, and iterating every pixel with Fixed numbers would be hundreds of times
+// slower. Instead we use "perturbation": iterate a single reference point C with Fixed
+// numbers, and every pixel c = C + dc only as its (tiny) difference from it.
+// If Z is the orbit of C and z = Z + d the orbit of c, then
+//     z*z + c = Z*Z + C + (2*Z*d + d*d + dc),   so   d' = 2*Z*d + d*d + dc.
+// Z only needs to be stored as doubles, because it is added to d only for the escape
+// test, and d and dc are small numbers that doubles hold with full precision however
+// small they are (down to about 1e-300).
+//
+// Two refinements:
+// - Glitches. When z comes very close to 0 while Z does not, d has lost its precision
+//   and the result is garbage. Such pixels are marked as GLITCHED and recomputed
+//   against a new reference picked among them (up to MAX_REFERENCES per pass; only
+//   each reference's orbit is slow, the glitched pixels are usually few).
+//   A pixel that outlives the reference's orbit (because C escaped first) needs a
+//   new reference too.
+// - Series approximation. For the first iterations, d is very nearly a polynomial
+//   in dc: d_n = A_n*dc + B_n*dc^2 + C_n*dc^3, with coefficients that depend only on
+//   the reference. So every pixel can start at the last iteration for which that
+//   polynomial is still accurate over the whole screen, and skip all those before.
+const double DEEP_ZOOM_SCALE = 1e-12;
+const double MIN_SCALE = 1e-60;        // Fixed runs out of digits not far below this.
+const int GLITCHED = -1;               // The iteration count of a glitched pixel.
+const int MAX_REFERENCES = 32;
+const double GLITCH_TOLERANCE = 1e-6;  // |z|^2 < this * |Z|^2 means a glitch.
+const double SERIES_TOLERANCE = 1e-9;  // How small the dropped terms must stay.
+
+bool needs_deep_zoom(const View& view) { return view.scale < DEEP_ZOOM_SCALE; }
+
+// The orbit of one reference point, and the series coefficients along it.
+struct DeepReference {
+    Fixed re, im;                 // The reference point C...
+    double re_double = 0, im_double = 0; // ...and roughly, for smooth_count().
+    std::vector<double> zr, zi;   // Z_0, Z_1, ... up to the iteration at which C escaped.
+    std::vector<std::complex<double>> a, b, c; // A_n, B_n and C_n of the series.
+    int max_iterations = 0;
+    // The last reference of a pass accepts glitched results rather than leaving holes.
+    bool detect_glitches = true;
+};
+
+// Iterates the reference point with Fixed numbers, the only slow part of a deep render.
+void compute_reference(DeepReference& ref, const Fixed& re, const Fixed& im, int max_iterations) {
+    ref.re = re;
+    ref.im = im;
+    ref.re_double = re.to_double();
+    ref.im_double = im.to_double();
+    ref.max_iterations = max_iterations;
+    ref.zr.assign(1, 0.0);
+    ref.zi.assign(1, 0.0);
+    Fixed zr, zi;
+    for (int n = 0; n < max_iterations; ++n) {
+        Fixed zr2 = zr * zr, zi2 = zi * zi, zri = zr * zi;
+        if ((zr2 + zi2).to_double() >= 4.0) break;
+        zi = zri + zri + im;
+        zr = zr2 - zi2 + re;
+        ref.zr.push_back(zr.to_double());
+        ref.zi.push_back(zi.to_double());
+    }
+    // A_{n+1} = 2*Z_n*A_n + 1, B_{n+1} = 2*Z_n*B_n + A_n^2, C_{n+1} = 2*Z_n*C_n + 2*A_n*B_n,
+    // which is what d' = 2*Z*d + d*d + dc gives when d is replaced by the polynomial.
+    size_t length = ref.zr.size();
+    ref.a.assign(length, 0.0);
+    ref.b.assign(length, 0.0);
+    ref.c.assign(length, 0.0);
+    for (size_t n = 0; n + 1 < length; ++n) {
+        std::complex<double> z2(2 * ref.zr[n], 2 * ref.zi[n]);
+        ref.a[n + 1] = z2 * ref.a[n] + 1.0;
+        ref.b[n + 1] = z2 * ref.b[n] + ref.a[n] * ref.a[n];
+        ref.c[n + 1] = z2 * ref.c[n] + 2.0 * ref.a[n] * ref.b[n];
+    }
+}
+
+// How many iterations the series can skip for pixels up to 'radius' away from the
+// reference: as long as the cubic term is negligible next to the linear one, the
+// terms after it (which we don't have) are even smaller.
+int series_skip(const DeepReference& ref, double radius) {
+    int skip = 0;
+    for (size_t n = 1; n < ref.a.size(); ++n) {
+        if (std::abs(ref.c[n]) * radius * radius > SERIES_TOLERANCE * std::abs(ref.a[n])) break;
+        skip = static_cast<int>(n);
+    }
+    // Leave the last stretch to the pixels: after the reference escapes, or at the
+    // limit, they have to find out for themselves.
+    return std::max(0, std::min(skip, static_cast<int>(ref.a.size()) - 2));
+}
+
+// The perturbation loop for 'count' pixels at dc = (dr[i], di[i]) from the reference,
+// starting at iteration 'skip'. Same results as mandelbrot(), but for GLITCHED.
+void kernel_perturbation(const DeepReference& ref, int skip, const double* dr, const double* di, int count,
+                         int* out, float* smooth) {
+    const int length = static_cast<int>(ref.zr.size());
+    for (int i = 0; i < count; ++i) {
+        std::complex<double> dc(dr[i], di[i]);
+        std::complex<double> d = ((ref.c[skip] * dc + ref.b[skip]) * dc + ref.a[skip]) * dc;
+        double cr = dr[i], ci = di[i];
+        double d_r = d.real(), d_i = d.imag();
+        double zr = 0, zi = 0;
+        int n = skip;
+        while (n < ref.max_iterations) {
+            if (n >= length) { // The reference escaped before this pixel did.
+                if (ref.detect_glitches) n = GLITCHED;
+                break;
+            }
+            zr = ref.zr[n] + d_r;
+            zi = ref.zi[n] + d_i;
+            double r2 = zr * zr + zi * zi;
+            if (r2 >= 4.0) break;
+            double ref2 = ref.zr[n] * ref.zr[n] + ref.zi[n] * ref.zi[n];
+            if (ref.detect_glitches && r2 < GLITCH_TOLERANCE * ref2) {
+                n = GLITCHED;
+                break;
+            }
+            // d' = 2*Z*d + d*d + dc = (2*Z + d) * d + dc
+            double tr = 2 * ref.zr[n] + d_r, ti = 2 * ref.zi[n] + d_i;
+            double nr = tr * d_r - ti * d_i + cr;
+            d_i = tr * d_i + ti * d_r + ci;
+            d_r = nr;
+            ++n;
+        }
+        out[i] = n;
+        if (smooth != nullptr) {
+            smooth[i] = n == GLITCHED ? 0.0f
+                                      : smooth_count(n, ref.max_iterations, zr, zi, ref.re_double + cr, ref.im_double + ci);
+        }
+    }
+}
+
+// A rectangle of pixels: columns [x0, x1) of rows [y0, y1).
+struct Tile {
+    int x0, y0, x1, y1;
+};
+
+// Cuts the rectangle [x0, x1) x [y0, y1) into tiles, row by row, and appends them.
+void append_tiles(std::vector<Tile>& tiles, int x0, int y0, int x1, int y1, int tile_size) {
+    for (int y = y0; y < y1; y += tile_size) {
+        for (int x = x0; x < x1; x += tile_size) {
+            tiles.push_back({x, y, std::min(x + tile_size, x1), std::min(y + tile_size, y1)});
+        }
+    }
+}
+
+// Cuts a width x height image into tiles, row by row.
+std::vector<Tile> make_tiles(int width, int height, int tile_size) {
+    std::vector<Tile> tiles;
+    append_tiles(tiles, 0, 0, width, height, tile_size);
+    return tiles;
+}
+
+// A pool of threads that works through a list of tiles.
+//
+// Why not just give each thread an equal share of the rows? Because the cost of a
+// pixel ranges from 1 iteration (far outside the set) to MAX_ITERATIONS (inside it),
+// so the thread that gets the middle of the image would still be busy long after the
+// others are done. Instead, each thread starts with an equal run of tiles and works
+// through it from the front; a thread that runs out "steals" the back half of the
+// run of another thread. Every tile is still computed exactly once and each pixel
+// does not depend on who computed it, so the picture is the same for any number of
+// threads.
+//
+// Each run is a pair [begin, end) of tile numbers packed into one 64-bit atomic, so
+// taking a tile (begin + 1) or stealing half (end - half) is a single compare-and-swap
+// and no thread ever waits on a lock while tiles are handed out.
+class TilePool {
+public:
+    // 'threads' includes the calling thread, which works along in run().
+    explicit TilePool(int threads)
+        : count_(threads < 1 ? 1 : threads), queues_(new Queue[count_]) {
+        for (int w = 1; w < count_; ++w) {
+            threads_.emplace_back([this, w] { thread_main(w); });
+        }
+    }
+
+    ~TilePool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (std::thread& t : threads_) t.join();
+    }
+
+    TilePool(const TilePool&) = delete;
+    TilePool& operator=(const TilePool&) = delete;
+
+    int size() const { return count_; }
+
+    // Calls job(i) once for every i in [0, tile_count) and returns when all are done.
+    void run(int tile_count, const std::function<void(int)>& job) {
+        // Deal out equal runs of tiles.
+        for (int w = 0; w < count_; ++w) {
+            uint32_t begin = static_cast<uint32_t>(static_cast<int64_t>(tile_count) * w / count_);
+            uint32_t end = static_cast<uint32_t>(static_cast<int64_t>(tile_count) * (w + 1) / count_);
+            queues_[w].range.store(pack(begin, end), std::memory_order_relaxed);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            job_ = &job;
+            busy_ = count_ - 1;
+            ++generation_;
+        }
+        wake_.notify_all();
+
+        work(0); // The calling thread is worker 0.
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [this] { return busy_ == 0; });
+        job_ = nullptr;
+    }
+
+private:
+    // One run of tiles. Each sits on its own cache line, so threads taking tiles from
+    // their own run don't slow each other down.
+    struct alignas(64) Queue {
+        std::atomic<uint64_t> range{0};
+    };
+
+    static uint64_t pack(uint32_t begin, uint32_t end) { return (static_cast<uint64_t>(end) << 32) | begin; }
+    static uint32_t begin_of(uint64_t range) { return static_cast<uint32_t>(range); }
+    static uint32_t end_of(uint64_t range) { return static_cast<uint32_t>(range >> 32); }
+
+    // Takes the first tile of our own run.
+    bool pop_own(int w, uint32_t& tile) {
+        uint64_t range = queues_[w].range.load(std::memory_order_acquire);
+        while (begin_of(range) < end_of(range)) {
+            if (queues_[w].range.compare_exchange_weak(range, pack(begin_of(range) + 1, end_of(range)),
+                                                       std::memory_order_acq_rel)) {
+                tile = begin_of(range);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Takes the back half of another worker's run, keeps its first tile and makes the
+    // rest our own run.
+    bool steal(int w, uint32_t& tile) {
+        for (int k = 1; k < count_; ++k) {
+            Queue& victim = queues_[(w + k) % count_];
+            uint64_t range = victim.range.load(std::memory_order_acquire);
+            while (begin_of(range) < end_of(range)) {
+                uint32_t half = (end_of(range) - begin_of(range) + 1) / 2;
+                uint32_t split = end_of(range) - half;
+                if (victim.range.compare_exchange_weak(range, pack(begin_of(range), split), std::memory_order_acq_rel)) {
+                    // Our own run is empty, so no one else is touching it.
+                    queues_[w].range.store(pack(split + 1, end_of(range)), std::memory_order_release);
+                    tile = split;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    // Runs tiles until every run is empty. No tiles are added while a batch runs, so
+    // finding nothing to steal means we are done.
+    void work(int w) {
+        uint32_t tile;
+        while (pop_own(w, tile) || steal(w, tile)) {
+            (*job_)(static_cast<int>(tile));
+        }
+    }
+
+    void thread_main(int w) {
+        uint64_t seen = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait(lock, [&] { return stop_ || generation_ != seen; });
+                if (stop_) return;
+                seen = generation_;
+            }
+            work(w);
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                --busy_;
+            }
+            done_.notify_one();
+        }
+    }
+
+    int count_;
+    std::unique_ptr<Queue[]> queues_;
+    std::vector<std::thread> threads_;
+    std::mutex mutex_;
+    std::condition_variable wake_;  // Signals a new batch (or shutdown) to the workers.
+    std::condition_variable done_;  // Signals run() that a worker finished its batch.
+    const std::function<void(int)>* job_ = nullptr;
+    uint64_t generation_ = 0;       // Counts batches, so a worker never runs one twice.
+    int busy_ = 0;                  // Workers (besides the caller) still in this batch.
+    bool stop_ = false;
+};
+
+// Palettes: how a (smooth) iteration count outside the set becomes a color. Points
+// inside the set are always black.
+
+// The original colors: shades of blue and green. The modulo operator (%) helps to
+// cycle through colors if MAX_ITERATIONS is large and prevents a single color from
+// dominating. With a smooth count, the steps between the colors disappear.
+sf::Color palette_classic(double mu, int /*max_iterations*/) {
+    return sf::Color(static_cast<sf::Uint8>(std::fmod(mu * 5, 255)), static_cast<sf::Uint8>(std::fmod(mu * 10, 255)),
+                     static_cast<sf::Uint8>(std::fmod(mu * 15, 255)));
+}
+
+// A gradient through dark blue, white, orange and black, repeated every 'period'
+// iterations (measured on a square-root scale, so the bands don't get too narrow
+// close to the set).
+sf::Color palette_gradient(double mu, int /*max_iterations*/) {
+    struct Stop {
+        double at;
+        double r, g, b;
+    };
+    static const Stop stops[] = {{0.0, 0, 7, 100},       {0.16, 32, 107, 203}, {0.42, 237, 255, 255},
+                                 {0.6425, 255, 170, 0}, {0.8575, 0, 2, 0},    {1.0, 0, 7, 100}};
+    const double period = 4.0;
+    double t = std::fmod(std::sqrt(mu) / period, 1.0);
+    int k = 0;
+    while (t > stops[k + 1].at) ++k;
+    double f = (t - stops[k].at) / (stops[k + 1].at - stops[k].at);
+    auto mix = [f](double a, double b) { return static_cast<sf::Uint8>(a + (b - a) * f); };
+    return sf::Color(mix(stops[k].r, stops[k + 1].r), mix(stops[k].g, stops[k + 1].g), mix(stops[k].b, stops[k + 1].b));
+}
+
+// Shades of grey from black to white across the whole range of iterations.
+sf::Color palette_grey(double mu, int max_iterations) {
+    double t = std::log(1 + mu) / std::log(1.0 + max_iterations);
+    sf::Uint8 v = static_cast<sf::Uint8>(255 * std::sqrt(t));
+    return sf::Color(v, v, v);
+}
+
+struct Palette {
+    const char* name;
+    sf::Color (*color)(double mu, int max_iterations);
+};
+
+const Palette PALETTES[] = {{"classic", palette_classic}, {"gradient", palette_gradient}, {"grey", palette_grey}};
+const int PALETTE_COUNT = sizeof(PALETTES) / sizeof(PALETTES[0]);
+
+// A palette function costs a few divisions, a square root and such, far too much to
+// pay for every pixel of every frame. So we compute it once for every 1/steps of an
+// iteration from 0 to max_iterations and store the results in a table. Coloring a
+// pixel is then just looking up an entry. The table only changes with the palette or
+// the iteration limit.
+const int COLOR_STEPS_PER_ITERATION = 8;
+const int MAX_COLOR_TABLE_SIZE = 1 << 22; // Fewer steps for very high iteration limits.
+
+class ColorTable {
+public:
+    explicit ColorTable(int palette = 0, int max_iterations = MAX_ITERATIONS) { build(palette, max_iterations); }
+
+    // Computes the table for this palette and limit (if it isn't already).
+    void build(int palette, int max_iterations) {
+        if (palette == palette_ && max_iterations == max_iterations_) return;
+        palette_ = palette;
+        max_iterations_ = max_iterations;
+        steps_ = std::max(1, std::min(COLOR_STEPS_PER_ITERATION, MAX_COLOR_TABLE_SIZE / std::max(1, max_iterations)));
+        size_t entries = static_cast<size_t>(max_iterations) * steps_ + 1;
+        rgba_.resize(entries * 4);
+        for (size_t i = 0; i < entries; ++i) {
+            sf::Color color = PALETTES[palette].color(static_cast<double>(i) / steps_, max_iterations);
+            rgba_[i * 4 + 0] = color.r;
+            rgba_[i * 4 + 1] = color.g;
+            rgba_[i * 4 + 2] = color.b;
+            rgba_[i * 4 + 3] = 255;
+        }
+        ++version_;
+    }
+
+    // The 4 bytes of the color for a pixel with this count and smooth count.
+    const sf::Uint8* lookup(int count, float smooth) const {
+        static const sf::Uint8 black[4] = {0, 0, 0, 255}; // Points inside the set are black
+        if (count >= max_iterations_) return black;
+        size_t i = static_cast<size_t>(std::max(0.0f, smooth) * steps_);
+        return &rgba_[std::min(i, rgba_.size() / 4 - 1) * 4];
+    }
+
+    int palette() const { return palette_; }
+    int max_iterations() const { return max_iterations_; }
+    int steps() const { return steps_; }
+    const std::vector<sf::Uint8>& rgba() const { return rgba_; }
+    uint64_t version() const { return version_; } // Changes with every build.
+
+private:
+    int palette_ = -1, max_iterations_ = -1, steps_ = 1;
+    std::vector<sf::Uint8> rgba_;
+    uint64_t version_ = 0;
+};
+
+// The picture we render into. All arrays are "row-major": pixel (x, y) is at index
+// y * width + x, so walking along a row walks straight through memory, which is the
+// order the CPU caches and prefetcher handle best. 'pixels' holds 4 bytes (red, green,
+// blue, alpha) per pixel, exactly the layout sf::Texture::update() expects, so a whole
+// frame reaches the GPU in one call instead of one setPixel() call per pixel.
+// The iteration counts are kept next to the colors, so another palette only needs a
+// recolor(), not a new render.
+// The buffers are allocated once and reused for every frame.
+class Framebuffer {
+public:
+    Framebuffer(int width, int height)
+        : width_(width), height_(height),
+          counts_(static_cast<size_t>(width) * height),
+          smooth_(static_cast<size_t>(width) * height),
+          pixels_(static_cast<size_t>(width) * height * 4) {}
+
+    int width() const { return width_; }
+    int height() const { return height_; }
+
+    // The iteration counts, one int per pixel.
+    std::vector<int>& counts() { return counts_; }
+    int* count_row(int y) { return &counts_[static_cast<size_t>(y) * width_]; }
+
+    // The smooth iteration counts, for coloring.
+    float* smooth_row(int y) { return &smooth_[static_cast<size_t>(y) * width_]; }
+
+    // The colors, 4 bytes per pixel.
+    const sf::Uint8* pixels() const { return pixels_.data(); }
+    sf::Uint8* pixel_row(int y) { return &pixels_[static_cast<size_t>(y) * width_ * 4]; }
+
+    // Moves the picture 'dx' pixels right and 'dy' pixels down, for panning. The strips
+    // that move in from the edges keep stale values until they are rendered again.
+    void shift(int dx, int dy) {
+        int width = width_ - std::abs(dx);
+        if (width <= 0 || std::abs(dy) >= height_) return;
+        int to_x = std::max(dx, 0), from_x = std::max(-dx, 0);
+        // Walk against the direction of the move, so no row is overwritten before it was copied.
+        for (int i = 0; i < height_ - std::abs(dy); ++i) {
+            int to_y = dy > 0 ? height_ - 1 - i : i;
+            int from_y = to_y - dy;
+            memmove(count_row(to_y) + to_x, count_row(from_y) + from_x, sizeof(int) * width);
+            memmove(smooth_row(to_y) + to_x, smooth_row(from_y) + from_x, sizeof(float) * width);
+            memmove(pixel_row(to_y) + to_x * 4, pixel_row(from_y) + from_x * 4, 4 * static_cast<size_t>(width));
+        }
+    }
+
+    // Colors every pixel again from its counts.
+    void recolor(const ColorTable& colors) {
+        for (size_t i = 0; i < counts_.size(); ++i) memcpy(&pixels_[i * 4], colors.lookup(counts_[i], smooth_[i]), 4);
+    }
+
+private:
+    int width_, height_;
+    std::vector<int> counts_;
+    std::vector<float> smooth_;
+    std::vector<sf::Uint8> pixels_;
+};
+
+// Everything the workers need to render one frame (or one pass of it).
+struct FrameJob {
+    const std::vector<Tile>* tiles;
+    Framebuffer* frame;
+    const Kernel* kernel;
+    View view;
+    const ColorTable* colors = nullptr; // Must be built for 'max_iterations'.
+    // Progressive rendering: compute only every step-th pixel of every step-th row and
+    // paint it as a step x step block. With 'skip_coarser' the pixels the previous,
+    // twice as coarse pass already computed are left alone.
+    int step = 1;
+    bool skip_coarser = false;
+    int max_iterations = MAX_ITERATIONS;
+    // Fill rectangles with a uniform border without computing their inside (see
+    // render_subdivided()). Only used for full-resolution passes.
+    bool subdivide = false;
+    // A deep view is computed by perturbation against 'deep' (see aim_at()): the top-left
+    // pixel lies (deep_re, deep_im) from the reference, and 'deep_skip' iterations are
+    // covered by the series. With 'only_glitched', only GLITCHED pixels are recomputed.
+    const DeepReference* deep = nullptr;
+    double deep_re = 0, deep_im = 0;
+    int deep_skip = 0;
+    bool only_glitched = false;
+    // The render is abandoned as soon as *generation no longer equals 'expected'.
+    const std::atomic<uint64_t>* generation = nullptr;
+    uint64_t expected = 0;
+
+    bool cancelled() const {
+        return generation != nullptr && generation->load(std::memory_order_relaxed) != expected;
+    }
+
+    // Whether this pass computes pixel (x, y) itself, rather than copying it from the
+    // block it belongs to or leaving it from the coarser pass. (Passes coarser than
+    // one pixel only run on tiles that start at multiples of TILE_SIZE.)
+    bool computes(int x, int y) const {
+        if (x % step != 0 || y % step != 0) return false;
+        return !(skip_coarser && x % (2 * step) == 0 && y % (2 * step) == 0);
+    }
+
+    // The point of pixel (x, y), as (cr, ci): itself, or its distance from the reference.
+    void point(int x, int y, double& cr, double& ci) const {
+        if (deep != nullptr) {
+            cr = deep_re + x * view.scale;
+            ci = deep_im + y * view.scale;
+        } else {
+            std::complex<double> c = view.at(x, y);
+            cr = c.real();
+            ci = c.imag();
+        }
+    }
+
+    void compute(const double* cr, const double* ci, int count, int* out, float* smooth) const {
+        if (deep != nullptr) {
+            kernel_perturbation(*deep, deep_skip, cr, ci, count, out, smooth);
+        } else {
+            kernel->function(cr, ci, count, max_iterations, out, smooth);
+        }
+    }
+};
+
+// Prepares 'job' to render its view by perturbation against 'ref'.
+void aim_at(FrameJob& job, const DeepReference& ref) {
+    job.deep = &ref;
+    job.deep_re = (job.view.re_exact - ref.re).to_double();
+    job.deep_im = (job.view.im_exact - ref.im).to_double();
+    // The series must hold for the pixel farthest from the reference, one of the corners.
+    double radius = 0;
+    for (int x : {0, job.frame->width()}) {
+        for (int y : {0, job.frame->height()}) {
+            radius = std::max(radius, std::hypot(job.deep_re + x * job.view.scale, job.deep_im + y * job.view.scale));
+        }
+    }
+    job.deep_skip = series_skip(ref, radius);
+}
+
+// Stores 'count', 'smooth' and their color in every pixel of the rectangle
+// [x0, x1) x [y0, y1).
+void paint(const FrameJob& job, int x0, int y0, int x1, int y1, int count, float smooth) {
+    const sf::Uint8* color = job.colors->lookup(count, smooth);
+    for (int y = y0; y < y1; ++y) {
+        int* count_out = job.frame->count_row(y);
+        float* smooth_out = job.frame->smooth_row(y);
+        sf::Uint8* rgba = job.frame->pixel_row(y);
+        for (int x = x0; x < x1; ++x) {
+            count_out[x] = count;
+            smooth_out[x] = smooth;
+            memcpy(rgba + x * 4, color, 4);
+        }
+    }
+}
+
+// Rectangles this small (or smaller) are simply computed pixel by pixel.
+const int SUBDIVIDE_MIN_SIZE = 8;
+
+// Mariani-Silver subdivision: compute only the border of a rectangle. If every border
+// pixel has the same count, assume the inside has it too and fill it in; otherwise
+// cut the inside into four and do the same with each quarter. Large areas inside the
+// set, or in one band of color, then cost only their outline.
+//
+// Unlike the early-outs in mandelbrot(), this one can be wrong: a thin filament of
+// the set can cross a rectangle without touching its border, and then it disappears.
+// (For the black areas it is safe, because the set has no holes, but bands of color
+// can hide one.) That is why it is an option, switched on with the S key.
+void render_subdivided(const FrameJob& job, int x0, int y0, int x1, int y1) {
+    if (x0 >= x1 || y0 >= y1 || job.cancelled()) return;
+    if (x1 - x0 <= SUBDIVIDE_MIN_SIZE || y1 - y0 <= SUBDIVIDE_MIN_SIZE) {
+        double cr[TILE_SIZE], ci[TILE_SIZE];
+        int counts[TILE_SIZE];
+        float smooth[TILE_SIZE];
+        for (int y = y0; y < y1; ++y) {
+            for (int x = x0; x < x1; ++x) job.point(x, y, cr[x - x0], ci[x - x0]);
+            job.compute(cr, ci, x1 - x0, counts, smooth);
+            for (int x = x0; x < x1; ++x) paint(job, x, y, x + 1, y + 1, counts[x - x0], smooth[x - x0]);
+        }
+        return;
+    }
+
+    // The border: the top and bottom rows, then the left and right columns in between.
+    double cr[4 * TILE_SIZE], ci[4 * TILE_SIZE];
+    int counts[4 * TILE_SIZE], xs[4 * TILE_SIZE], ys[4 * TILE_SIZE];
+    float smooth[4 * TILE_SIZE];
+    int n = 0;
+    auto add = [&](int x, int y) {
+        job.point(x, y, cr[n], ci[n]);
+        xs[n] = x;
+        ys[n] = y;
+        ++n;
+    };
+    for (int x = x0; x < x1; ++x) add(x, y0), add(x, y1 - 1);
+    for (int y = y0 + 1; y < y1 - 1; ++y) add(x0, y), add(x1 - 1, y);
+    job.compute(cr, ci, n, counts, smooth);
+
+    bool uniform = true;
+    for (int i = 0; i < n; ++i) {
+        paint(job, xs[i], ys[i], xs[i] + 1, ys[i] + 1, counts[i], smooth[i]);
+        uniform = uniform && counts[i] == counts[0];
+    }
+    if (uniform) {
+        // (The smooth count is not quite uniform; the first one stands in for all.)
+        paint(job, x0 + 1, y0 + 1, x1 - 1, y1 - 1, counts[0], smooth[0]);
+        return;
+    }
+    // The quarters of the inside each get their own border, so no pixel is computed twice.
+    int xm = (x0 + x1) / 2, ym = (y0 + y1) / 2;
+    render_subdivided(job, x0 + 1, y0 + 1, xm, ym);
+    render_subdivided(job, xm, y0 + 1, x1 - 1, ym);
+    render_subdivided(job, x0 + 1, ym, xm, y1 - 1);
+    render_subdivided(job, xm, ym, x1 - 1, y1 - 1);
+}
+
+// Computes one tile, row by row: the iteration counts of a row go through the SIMD
+// kernel in one call, then the row is colored while its counts are still in the cache.
+void render_tile(const FrameJob& job, int index) {
+    const Tile& tile = (*job.tiles)[index];
+    const int step = job.step;
+    if (job.subdivide && step == 1 && !job.skip_coarser) {
+        render_subdivided(job, tile.x0, tile.y0, tile.x1, tile.y1);
+        return;
+    }
+    double cr[TILE_SIZE], ci[TILE_SIZE];
+    int counts[TILE_SIZE], xs[TILE_SIZE];
+    float smooth[TILE_SIZE];
+    for (int y = tile.y0; y < tile.y1; y += step) {
+        if (job.cancelled()) return; // The view changed: stop wasting time on this one.
+
+        // In a refining pass, every other row was fully done by the coarser pass and
+        // only needs its odd multiples of 'step' now.
+        int first = tile.x0, stride = step;
+        if (job.skip_coarser && y % (2 * step) == 0) {
+            first = tile.x0 + step;
+            stride = 2 * step;
+        }
+        int n = 0;
+        for (int x = first; x < tile.x1; x += stride) {
+            if (job.only_glitched && job.frame->count_row(y)[x] != GLITCHED) continue;
+            job.point(x, y, cr[n], ci[n]);
+            xs[n++] = x;
+        }
+        if (n == 0) continue;
+        job.compute(cr, ci, n, counts, smooth);
+
+        // Write each result into its step x step block (a single pixel in the last pass).
+        int y_end = std::min(y + step, tile.y1);
+        for (int i = 0; i < n; ++i) {
+            paint(job, xs[i], y, std::min(xs[i] + step, tile.x1), y_end, counts[i], smooth[i]);
+        }
+    }
+}
+
+// Renders a whole job with the thread pool. The job is handed to the pool through
+// a single reference, which std::function stores without allocating, so rendering a
+// frame allocates no memory at all.
+void render_job(TilePool& pool, const FrameJob& job) {
+    pool.run(static_cast<int>(job.tiles->size()), [&job](int index) { render_tile(job, index); });
+}
+
+// Renders one pass of a job. For a deep view, the glitched pixels are then computed
+// again against a new reference, in the middle of them, until none are left.
+void render_pass(TilePool& pool, FrameJob& job, DeepReference& glitch_reference) {
+    render_job(pool, job);
+    if (job.deep == nullptr) return;
+    FrameJob fix = job;
+    fix.only_glitched = true;
+    fix.subdivide = false; // Subdivision would compute whole tiles again, not just the glitches
+    std::vector<int> glitched;
+    for (int attempt = 1; attempt <= MAX_REFERENCES && !job.cancelled(); ++attempt) {
+        // The glitched pixels this pass computes (the others are copies of them).
+        glitched.clear();
+        for (int y = 0; y < job.frame->height(); y += job.step) {
+            const int* counts = job.frame->count_row(y);
+            for (int x = 0; x < job.frame->width(); x += job.step) {
+                if (counts[x] == GLITCHED && job.computes(x, y)) glitched.push_back(y * job.frame->width() + x);
+            }
+        }
+        if (glitched.empty()) return;
+        // The one halfway through them, in reading order, becomes the new reference.
+        // Being its own reference, that pixel at least is sure to come out right.
+        int index = glitched[glitched.size() / 2];
+        double x = static_cast<double>(index % job.frame->width());
+        double y = static_cast<double>(index / job.frame->width());
+        compute_reference(glitch_reference, job.view.re_exact + Fixed(x * job.view.scale),
+                          job.view.im_exact + Fixed(y * job.view.scale), job.max_iterations);
+        glitch_reference.detect_glitches = attempt < MAX_REFERENCES;
+        aim_at(fix, glitch_reference);
+        render_job(pool, fix);
+    }
+}
+
+// Computes the reference orbit for a deep view, at the center of the frame.
+void compute_center_reference(DeepReference& ref, const View& view, int width, int height, int max_iterations) {
+    compute_reference(ref, view.re_exact + Fixed(width / 2 * view.scale), view.im_exact + Fixed(height / 2 * view.scale),
+                      max_iterations);
+}
+
+// Renders a whole frame of the standard view in one full-resolution pass.
+void render_frame(TilePool& pool, const std::vector<Tile>& tiles, Framebuffer& frame,
+                  const Kernel& kernel = active_kernel()) {
+    static const ColorTable colors;
+    FrameJob job = {&tiles, &frame, &kernel, View()};
+    job.colors = &colors;
+    render_job(pool, job);
+}
+
+// Renders views in the background, so the window stays responsive while it works.
+//
+// A new view is shown at once as a coarse preview (one pixel in 8x8) and then
+// refined in passes of 4, 2 and finally 1, each pass computing only the pixels the
+// previous one skipped. After every pass the result is handed to the window.
+// Asking for another view cancels the current render within a row of pixels.
+// When the new view is the old one moved by whole pixels (a drag), the finished frame
+// is shifted and only the strips that moved into view are computed.
+// With subdivision switched on, the 8x8 preview is followed by one subdivided
+// full-resolution pass instead, since subdivision needs whole rectangles.
+// Deep views are rendered the same way, only by perturbation against a reference
+// orbit at the center of the view. The orbit is kept while the view is only dragged.
+class ProgressiveRenderer {
+public:
+    // What else, besides the view, decides the picture.
+    struct Settings {
+        bool subdivide = false;
+        int max_iterations = MAX_ITERATIONS;
+        int palette = 0; // Index into PALETTES.
+
+        // Whether the iteration counts come out the same (only the colors may differ).
+        bool same_counts(const Settings& other) const {
+            return subdivide == other.subdivide && max_iterations == other.max_iterations;
+        }
+        bool operator==(const Settings& other) const { return same_counts(other) && palette == other.palette; }
+        bool operator!=(const Settings& other) const { return !(*this == other); }
+    };
+
+    ProgressiveRenderer(int width, int height, int threads)
+        : frame_(width, height), display_(static_cast<size_t>(width) * height * 4),
+          pool_(threads), tiles_(make_tiles(width, height, TILE_SIZE)) {
+        thread_ = std::thread([this] { thread_main(); });
+    }
+
+    ~ProgressiveRenderer() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+            generation_.fetch_add(1); // Cancel whatever is running.
+        }
+        wake_.notify_one();
+        thread_.join();
+    }
+
+    // Starts rendering 'view', abandoning the view that is being rendered now.
+    void request(const View& view) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (view == requested_ && has_request_) return;
+            requested_ = view;
+            has_request_ = true;
+            generation_.fetch_add(1, std::memory_order_relaxed);
+        }
+        wake_.notify_one();
+    }
+
+    // Changes the settings (for example switches Mariani-Silver subdivision on or
+    // off), and renders the view again.
+    void configure(const Settings& settings) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (settings == settings_) return;
+            settings_ = settings;
+            generation_.fetch_add(1, std::memory_order_relaxed);
+        }
+        wake_.notify_one();
+    }
+
+    // Copies the newest finished pass into 'texture'. Returns false if nothing new.
+    bool upload(sf::Texture& texture) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!display_dirty_) return false;
+        texture.update(display_.data());
+        display_dirty_ = false;
+        return true;
+    }
+
+private:
+    void thread_main() {
+        uint64_t done_generation = 0;
+        while (true) {
+            View view;
+            uint64_t generation;
+            Settings settings;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait(lock, [&] { return stop_ || (has_request_ && generation_.load() != done_generation); });
+                if (stop_) return;
+                view = requested_;
+                generation = generation_.load();
+                settings = settings_;
+            }
+            render(view, settings, generation);
+            done_generation = generation;
+        }
+    }
+
+    void render(const View& view, const Settings& settings, uint64_t generation) {
+        FrameJob job = {&tiles_, &frame_, &active_kernel(), view};
+        job.generation = &generation_;
+        job.expected = generation;
+        job.subdivide = settings.subdivide;
+        job.max_iterations = settings.max_iterations;
+        colors_.build(settings.palette, settings.max_iterations);
+        job.colors = &colors_;
+
+        if (frame_complete_ && view == frame_view_ && settings.same_counts(frame_settings_)) {
+            // Only the palette changed: the counts are all there, just color them again.
+            frame_.recolor(colors_);
+            frame_settings_ = settings;
+            publish();
+            return;
+        }
+
+        int dx, dy;
+        if (frame_complete_ && frame_settings_ == settings && pixel_shift_between(frame_view_, view, dx, dy) &&
+            std::abs(dx) < frame_.width() && std::abs(dy) < frame_.height()) {
+            // Keep the pixels that are still on screen and render only the new strips.
+            frame_.shift(dx, dy);
+            frame_view_ = view;
+            strip_tiles_.clear();
+            int w = frame_.width(), h = frame_.height();
+            if (dx > 0) append_tiles(strip_tiles_, 0, 0, dx, h, TILE_SIZE);
+            if (dx < 0) append_tiles(strip_tiles_, w + dx, 0, w, h, TILE_SIZE);
+            int x0 = std::max(dx, 0), x1 = w + std::min(dx, 0); // Columns not covered above.
+            if (dy > 0) append_tiles(strip_tiles_, x0, 0, x1, dy, TILE_SIZE);
+            if (dy < 0) append_tiles(strip_tiles_, x0, h + dy, x1, h, TILE_SIZE);
+            job.tiles = &strip_tiles_;
+            if (needs_deep_zoom(view)) aim_at(job, reference_); // Same scale, so the same reference.
+            render_pass(pool_, job, glitch_reference_);
+            frame_complete_ = !job.cancelled();
+            if (frame_complete_) publish();
+            return;
+        }
+
+        frame_complete_ = false;
+        frame_view_ = view;
+        frame_settings_ = settings;
+        if (needs_deep_zoom(view)) {
+            compute_center_reference(reference_, view, frame_.width(), frame_.height(), settings.max_iterations);
+            aim_at(job, reference_);
+        }
+        for (int step = 8; step >= 1; step /= (settings.subdivide ? 8 : 2)) {
+            job.step = step;
+            job.skip_coarser = step < 8 && !settings.subdivide;
+            render_pass(pool_, job, glitch_reference_);
+            if (job.cancelled()) return;
+            publish();
+        }
+        frame_complete_ = true;
+    }
+
+    // Hands the current pixels to the window thread.
+    void publish() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        memcpy(display_.data(), frame_.pixels(), display_.size());
+        display_dirty_ = true;
+    }
+
+    Framebuffer frame_;              // Only the render thread touches this.
+    View frame_view_;                // What 'frame_' shows...
+    bool frame_complete_ = false;    // ...and whether all of it is final...
+    Settings frame_settings_;        // ...and how it was rendered.
+    ColorTable colors_;              // The colors for 'frame_settings_'.
+    DeepReference reference_;        // The reference orbit of a deep 'frame_view_'.
+    DeepReference glitch_reference_; // The latest reference for glitched pixels.
+    std::vector<sf::Uint8> display_; // The last finished pass, for the window (guarded by mutex_).
+    bool display_dirty_ = false;
+    TilePool pool_;
+    std::vector<Tile> tiles_;        // The tiles of the whole frame.
+    std::vector<Tile> strip_tiles_;  // The tiles of the strips exposed by a pan.
+
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    View requested_;
+    bool has_request_ = false;
+    Settings settings_;
+    bool stop_ = false;
+    std::atomic<uint64_t> generation_{0}; // Bumped by every request; cancels older renders.
+};
+
+// The GPU backend.
+//
+// A graphics card runs thousands of small programs at once, and the Mandelbrot set,
+// where every pixel is computed on its own, is the perfect job for it. A "fragment
+// shader" is a program the GPU runs for every pixel it draws; we draw one rectangle
+// over the whole image, and our shader computes the color of each pixel. It draws
+// into a texture on the graphics card (an sf::RenderTexture), so the picture never
+// travels through main memory: the sprite shows that texture directly.
+//
+// Floats have only 24 bits, which would look blocky after a few clicks of zoom, so
+// the shader computes with doubles. Those need OpenGL 4.0 or the extension
+// GL_ARB_gpu_shader_fp64; without it, or for deep views, the CPU does the work.
+// SFML can only pass floats to a shader, so each double travels as three floats that
+// add up to it exactly. 'precise' stops the GPU from fusing multiplies and adds, so
+// it computes the same points and counts as the CPU kernels.
+// The colors come from the same ColorTable as on the CPU, uploaded as a texture with
+// PALETTE_TEXTURE_WIDTH entries per row (one long row would be wider than GPUs
+// allow); the shader computes the smooth count and fetches entry mu * steps.
+const char* const GPU_FRAGMENT_SHADER = R"(
+#version 400 compatibility
+uniform vec3 re_start;      // Each double as the sum of three floats
+uniform vec3 im_start;
+uniform vec3 scale;
+uniform float height;
+uniform int max_iterations;
+uniform sampler2D palette;  // The ColorTable
+uniform int steps;          // Its entries per iteration
+
+const int PALETTE_TEXTURE_WIDTH = 1024;
+
+double unsplit(vec3 v) { return double(v.x) + double(v.y) + double(v.z); }
+
+// The same loop as mandelbrot() on the CPU, early-outs included. Returns the smooth
+// count like smooth_count() (GLSL has log2() only for floats, plenty for a color).
+float mandelbrot(double cr, double ci) {
+    precise double ci2 = ci * ci;
+    precise double xr = cr - 0.25;
+    precise double q = xr * xr + ci2;
+    precise double xb = cr + 1.0;
+    if (q * (q + xr) <= 0.25 * ci2 || xb * xb + ci2 <= 0.0625) return max_iterations;
+    precise double zr = 0.0, zi = 0.0, saved_r = 0.0, saved_i = 0.0;
+    int next_save = 8;
+    for (int n = 0; n < max_iterations; ++n) {
+        precise double zr2 = zr * zr;
+        precise double zi2 = zi * zi;
+        if (zr2 + zi2 >= 4.0) {
+            for (int k = 0; k < 3; ++k) {
+                precise double zri = zr * zi;
+                zr = (zr * zr - zi * zi) + cr;
+                zi = (zri + zri) + ci;
+            }
+            float log2_z = 0.5 * log2(float(zr * zr + zi * zi));
+            return clamp(n + 4 - log2(log2_z), 0.0, float(max_iterations));
+        }
+        precise double zri = zr * zi;
+        zi = (zri + zri) + ci;
+        zr = (zr2 - zi2) + cr;
+        if (zr == saved_r && zi == saved_i) return max_iterations;
+        if (n + 1 == next_save) {
+            saved_r = zr;
+            saved_i = zi;
+            next_save *= 2;
+        }
+    }
+    return max_iterations;
+}
+
+void main() {
+    // gl_FragCoord counts rows from the bottom; our pixel rows count from the top.
+    double x = floor(gl_FragCoord.x), y = height - 1.0 - floor(gl_FragCoord.y);
+    precise double cr = unsplit(re_start) + x * unsplit(scale);
+    precise double ci = unsplit(im_start) + y * unsplit(scale);
+    float mu = mandelbrot(cr, ci);
+    if (mu == float(max_iterations)) {
+        gl_FragColor = vec4(0.0, 0.0, 0.0, 1.0); // Points inside the set are black
+    } else {
+        int i = int(mu * steps);
+        gl_FragColor = texelFetch(palette, ivec2(i % PALETTE_TEXTURE_WIDTH, i / PALETTE_TEXTURE_WIDTH), 0);
+    }
+}
+)";
+
+// Splits a double into three floats whose sum is exactly the double again.
+sf::Glsl::Vec3 split_double(double d) {
+    float hi = static_cast<float>(d);
+    float mid = static_cast<float>(d - hi);
+    float lo = static_cast<float>(d - hi - mid);
+    return sf::Glsl::Vec3(hi, mid, lo);
+}
+
+const int PALETTE_TEXTURE_WIDTH = 1024; // As in the shader.
+
+class GpuRenderer {
+public:
+    // Compiles the shader and creates the texture. Returns false (and the CPU has to
+    // do the work) if the GPU can't run the shader.
+    bool create(int width, int height) {
+        if (!sf::Shader::isAvailable() || !sf::Context::isExtensionAvailable("GL_ARB_gpu_shader_fp64")) return false;
+        if (!shader_.loadFromMemory(GPU_FRAGMENT_SHADER, sf::Shader::Fragment)) return false;
+        if (!target_.create(width, height)) return false;
+        quad_.setSize(sf::Vector2f(static_cast<float>(width), static_cast<float>(height)));
+        shader_.setUniform("height", static_cast<float>(height));
+        ready_ = true;
+        return true;
+    }
+
+    // Whether the GPU can draw 'view' (once create() succeeded, anything but deep views).
+    bool can_render(const View& view) const { return ready_ && !needs_deep_zoom(view); }
+
+    // Draws 'view' into texture(), unless that is what it already shows.
+    void render(const View& view, int max_iterations, int palette) {
+        uint64_t version = colors_.version();
+        colors_.build(palette, max_iterations);
+        bool recolored = !uploaded_ || colors_.version() != version;
+        if (drawn_ && view == view_ && !recolored) return;
+        if (recolored) upload_colors();
+        shader_.setUniform("re_start", split_double(view.re_start));
+        shader_.setUniform("im_start", split_double(view.im_start));
+        shader_.setUniform("scale", split_double(view.scale));
+        shader_.setUniform("max_iterations", max_iterations);
+        target_.draw(quad_, &shader_);
+        target_.display();
+        view_ = view;
+        drawn_ = true;
+    }
+
+    const sf::Texture& texture() const { return target_.getTexture(); }
+
+    // Makes the next render() draw even if the view hasn't changed (for benchmarks).
+    void invalidate() { drawn_ = false; }
+
+private:
+    // Copies colors_ into palette_, a texture PALETTE_TEXTURE_WIDTH entries wide.
+    void upload_colors() {
+        std::vector<sf::Uint8> rgba = colors_.rgba();
+        size_t entries = rgba.size() / 4;
+        unsigned rows = static_cast<unsigned>((entries + PALETTE_TEXTURE_WIDTH - 1) / PALETTE_TEXTURE_WIDTH);
+        rgba.resize(static_cast<size_t>(rows) * PALETTE_TEXTURE_WIDTH * 4); // Fill up the last row
+        sf::Vector2u size = palette_.getSize();
+        if (size.x != PALETTE_TEXTURE_WIDTH || size.y != rows) palette_.create(PALETTE_TEXTURE_WIDTH, rows);
+        palette_.update(rgba.data());
+        shader_.setUniform("palette", palette_);
+        shader_.setUniform("steps", colors_.steps());
+        uploaded_ = true;
+    }
+
+    sf::Shader shader_;
+    sf::RenderTexture target_;
+    sf::RectangleShape quad_;   // One rectangle covering the whole texture.
+    bool ready_ = false;
+    bool drawn_ = false;
+    bool uploaded_ = false;     // Whether palette_ holds colors_ yet.
+    View view_;                 // What the texture shows.
+    ColorTable colors_;         // The colors it shows them in,
+    sf::Texture palette_;       // and the same on the graphics card.
+};
+
+// Headless rendering.
+//
+// "--render" renders to image files without opening a window, for machines without a
+// display: a single picture of any size (a poster of a billion pixels is fine), or a
+// sequence of frames zooming into a point, for an animation.
+//
+// A big picture doesn't fit in memory, and doesn't have to: it is rendered in strips
+// of full-width rows, and each strip goes to the file as soon as it is done, so only
+// one strip (at most STRIP_MEMORY bytes) is ever held. PNG files are written by hand,
+// so SFML (which wants the whole picture in an sf::Image first) isn't involved. The
+// pixels are stored uncompressed ("stored" deflate blocks): PNG requires the zlib
+// format, but not that anything is actually compressed, and this way we need no zlib.
+// Any other extension gets raw RGBA bytes, row by row, with no header.
+//
+// The frames of a zoom share their center, and a deep view's reference orbit (with
+// its series coefficients) depends only on that point and the iteration limit, so it
+// is computed once for the whole sequence rather than once per frame. The thread pool,
+// color table and strip buffers are reused as well.
+const size_t STRIP_MEMORY = 64 << 20;
+
+// Writes an image strip by strip, as PNG or raw RGBA.
+class ImageWriter {
+public:
+    // Creates 'path' for a width x height image. Returns false if it can't.
+    bool open(const std::string& path, int width, int height) {
+        png_ = path.size() >= 4 && path.compare(path.size() - 4, 4, ".png") == 0;
+        width_ = width;
+        file_.open(path, std::ios::binary);
+        if (!file_) return false;
+        if (png_) {
+            file_.write("\x89PNG\r\n\x1a\n", 8);
+            std::vector<sf::Uint8> header;
+            put32(header, width);
+            put32(header, height);
+            header.insert(header.end(), {8, 2, 0, 0, 0}); // 8 bits, RGB, the standard methods, no interlacing
+            write_chunk("IHDR", header);
+            data_ = {0x78, 0x01}; // The zlib header that starts the pixel data
+            adler_a_ = 1;
+            adler_b_ = 0;
+        }
+        return static_cast<bool>(file_);
+    }
+
+    // Appends 'rows' rows of RGBA pixels.
+    void write_rows(const sf::Uint8* rgba, int rows) {
+        if (!png_) {
+            file_.write(reinterpret_cast<const char*>(rgba), static_cast<std::streamsize>(rows) * width_ * 4);
+            return;
+        }
+        // Every PNG row starts with its filter type, 0 for none, and has no alpha here.
+        row_.resize(1 + static_cast<size_t>(width_) * 3);
+        for (int y = 0; y < rows; ++y) {
+            const sf::Uint8* in = rgba + static_cast<size_t>(y) * width_ * 4;
+            row_[0] = 0;
+            for (int x = 0; x < width_; ++x) memcpy(&row_[1 + x * 3], in + x * 4, 3);
+            add_data(row_.data(), row_.size());
+        }
+        flush_data();
+    }
+
+    // Finishes the file. Returns false if something couldn't be written.
+    bool close() {
+        if (png_) {
+            // An empty final block, then the checksum of all the pixel data.
+            data_.insert(data_.end(), {1, 0, 0, 0xff, 0xff});
+            put32(data_, (adler_b_ << 16) | adler_a_);
+            write_chunk("IDAT", data_);
+            write_chunk("IEND", {});
+        }
+        file_.close();
+        return !file_.fail();
+    }
+
+private:
+    // Adds bytes to the pixel data as stored blocks, at most 65535 bytes each.
+    void add_data(const sf::Uint8* bytes, size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            adler_a_ = (adler_a_ + bytes[i]) % 65521;
+            adler_b_ = (adler_b_ + adler_a_) % 65521;
+        }
+        while (size > 0) {
+            uint16_t length = static_cast<uint16_t>(std::min<size_t>(size, 65535));
+            data_.insert(data_.end(), {0, static_cast<sf::Uint8>(length), static_cast<sf::Uint8>(length >> 8),
+                                       static_cast<sf::Uint8>(~length), static_cast<sf::Uint8>(~length >> 8)});
+            data_.insert(data_.end(), bytes, bytes + length);
+            bytes += length;
+            size -= length;
+        }
+    }
+
+    // Writes the pixel data gathered so far as one IDAT chunk.
+    void flush_data() {
+        write_chunk("IDAT", data_);
+        data_.clear();
+    }
+
+    void write_chunk(const char* type, const std::vector<sf::Uint8>& data) {
+        std::vector<sf::Uint8> length;
+        put32(length, static_cast<uint32_t>(data.size()));
+        file_.write(reinterpret_cast<const char*>(length.data()), 4);
+        file_.write(type, 4);
+        file_.write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size()));
+        uint32_t crc = crc32(0xffffffffu, reinterpret_cast<const sf::Uint8*>(type), 4);
+        crc = crc32(crc, data.data(), data.size()) ^ 0xffffffffu;
+        std::vector<sf::Uint8> checksum;
+        put32(checksum, crc);
+        file_.write(reinterpret_cast<const char*>(checksum.data()), 4);
+    }
+
+    // Appends 'value' most significant byte first, as PNG wants it.
+    static void put32(std::vector<sf::Uint8>& out, uint32_t value) {
+        for (int shift = 24; shift >= 0; shift -= 8) out.push_back(static_cast<sf::Uint8>(value >> shift));
+    }
+
+    // The CRC-32 of PNG (and zip, and Ethernet), a byte at a time from a table.
+    static uint32_t crc32(uint32_t crc, const sf::Uint8* bytes, size_t size) {
+        static const std::vector<uint32_t> table = [] {
+            std::vector<uint32_t> t(256);
+            for (uint32_t n = 0; n < 256; ++n) {
+                uint32_t c = n;
+                for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+                t[n] = c;
+            }
+            return t;
+        }();
+        for (size_t i = 0; i < size; ++i) crc = table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+        return crc;
+    }
+
+    std::ofstream file_;
+    bool png_ = false;
+    int width_ = 0;
+    std::vector<sf::Uint8> data_; // Pixel data not yet written
+    std::vector<sf::Uint8> row_;
+    uint32_t adler_a_ = 1, adler_b_ = 0; // The running Adler-32 checksum of zlib
+};
+
+// Renders images of one size and iteration limit, strip by strip, on all cores.
+class BatchRenderer {
+public:
+    BatchRenderer(int width, int height, int max_iterations, int palette, int threads)
+        : width_(width), height_(height), max_iterations_(max_iterations),
+          // 12 bytes per pixel: the count, the smooth count and the color.
+          strip_rows_(static_cast<int>(std::max<size_t>(1, std::min<size_t>(height, STRIP_MEMORY / (12 * size_t(width)))))),
+          colors_(palette, max_iterations), pool_(threads), strip_(width, strip_rows_),
+          tiles_(make_tiles(width, strip_rows_, TILE_SIZE)) {}
+
+    // Renders the view centered on (re, im) with pixels of size 'scale' into 'path'.
+    // Returns false if the file couldn't be written.
+    bool render(const Fixed& re, const Fixed& im, double scale, const std::string& path) {
+        View view = centered_view(re, im, scale, width_, height_);
+        bool deep = needs_deep_zoom(view);
+        if (deep && !(has_reference_ && reference_.re == re && reference_.im == im)) {
+            compute_reference(reference_, re, im, max_iterations_); // The previous frame's, if it can
+            has_reference_ = true;
+        }
+
+        ImageWriter writer;
+        if (!writer.open(path, width_, height_)) return false;
+        for (int y0 = 0; y0 < height_; y0 += strip_rows_) {
+            int rows = std::min(strip_rows_, height_ - y0);
+            if (rows != strip_.height()) {
+                // The last strip can be shorter, it gets buffers of its own size.
+                strip_ = Framebuffer(width_, rows);
+                tiles_ = make_tiles(width_, rows, TILE_SIZE);
+            }
+            FrameJob job = {&tiles_, &strip_, &active_kernel(), view};
+            job.view.moved_from(view, 0, y0 * scale);
+            job.colors = &colors_;
+            job.max_iterations = max_iterations_;
+            if (deep) aim_at(job, reference_);
+            render_pass(pool_, job, glitch_reference_);
+            writer.write_rows(strip_.pixels(), rows);
+        }
+        return writer.close();
+    }
+
+private:
+    int width_, height_, max_iterations_;
+    int strip_rows_;                 // Rows per strip.
+    ColorTable colors_;
+    TilePool pool_;
+    Framebuffer strip_;
+    std::vector<Tile> tiles_;        // The tiles of 'strip_'.
+    DeepReference reference_;        // The reference orbit of deep views...
+    bool has_reference_ = false;     // ...once there is one.
+    DeepReference glitch_reference_;
+};
+
+// Replaces the run of '#' in 'pattern' by 'number' with as many digits, so
+// "zoom####.png" becomes "zoom0042.png" for frame 42.
+std::string frame_path(const std::string& pattern, int number) {
+    size_t first = pattern.find('#');
+    if (first == std::string::npos) return pattern;
+    size_t last = pattern.find_first_not_of('#', first);
+    if (last == std::string::npos) last = pattern.size();
+    std::string digits = std::to_string(number);
+    if (digits.size() < last - first) digits.insert(0, last - first - digits.size(), '0');
+    return pattern.substr(0, first) + digits + pattern.substr(last);
+}
+
+// "--render FILE [options]": renders without a window. See "Example Usage" at the end.
+int run_batch(int argc, char* argv[]) {
+    int width = WIDTH, height = HEIGHT, max_iterations = MAX_ITERATIONS, palette = 0, frames = 1;
+    double re_start = RE_START, re_end = RE_END, im_start = IM_START, im_end = IM_END, zoom = 0.5;
+    std::string output = argv[2];
+    try {
+        for (int i = 3; i < argc; ++i) {
+            std::string option = argv[i];
+            auto value = [&](int offset) -> std::string {
+                if (i + offset >= argc) throw std::invalid_argument(option + " needs a value");
+                return argv[i + offset];
+            };
+            if (option == "--size") {
+                std::string size = value(1);
+                size_t x = size.find('x');
+                if (x == std::string::npos) throw std::invalid_argument("--size wants WIDTHxHEIGHT");
+                width = std::stoi(size.substr(0, x));
+                height = std::stoi(size.substr(x + 1));
+                i += 1;
+            } else if (option == "--iterations") {
+                max_iterations = std::stoi(value(1));
+                i += 1;
+            } else if (option == "--view") {
+                re_start = std::stod(value(1));
+                re_end = std::stod(value(2));
+                im_start = std::stod(value(3));
+                im_end = std::stod(value(4));
+                i += 4;
+            } else if (option == "--palette") {
+                std::string name = value(1);
+                palette = -1;
+                for (int p = 0; p < PALETTE_COUNT; ++p) palette = name == PALETTES[p].name ? p : palette;
+                if (palette < 0) throw std::invalid_argument("unknown palette " + name);
+                i += 1;
+            } else if (option == "--frames") {
+                frames = std::stoi(value(1));
+                i += 1;
+            } else if (option == "--zoom") {
+                zoom = std::stod(value(1));
+                i += 1;
             } else {
-                // Create a simple color gradient based on the number of iterations
-                // We'll use shades of blue and green.
-                // The modulo operator (%) helps to cycle through colors if MAX_ITERATIONS is large
-                // and prevents a single color from dominating.
-                int r = (iterations * 5) % 255;
-                int g = (iterations * 10) % 255;
-                int b = (iterations * 15) % 255;
-                color = sf::Color(r, g, b);
+                throw std::invalid_argument("unknown option " + option);
             }
+        }
+        if (width <= 0 || height <= 0 || max_iterations <= 0 || frames <= 0 || !(zoom > 0)) {
+            throw std::invalid_argument("sizes, counts and the zoom must be positive");
+        }
+        if (!(re_end > re_start) || !(im_end > im_start)) throw std::invalid_argument("empty --view");
+        if (frames > 1 && output.find('#') == std::string::npos) {
+            throw std::invalid_argument("a sequence of frames needs '#' in the file name for the number");
+        }
+    } catch (const std::exception& error) {
+        std::cerr << "mandelbrot --render: " << error.what() << "\n";
+        return 2;
+    }
+
+    // The bounds shown as large as they fit; the rest of the picture shows more around them.
+    double scale = std::max((re_end - re_start) / width, (im_end - im_start) / height);
+    Fixed re = Fixed(0.5 * (re_start + re_end)), im = Fixed(0.5 * (im_start + im_end));
+
+    BatchRenderer renderer(width, height, max_iterations, palette, static_cast<int>(std::thread::hardware_concurrency()));
+    for (int frame = 0; frame < frames; ++frame, scale *= zoom) {
+        if (scale < MIN_SCALE) {
+            std::cerr << "mandelbrot --render: frame " << frame << " would zoom deeper than " << MIN_SCALE << "\n";
+            return 1;
+        }
+        std::string path = frame_path(output, frame);
+        auto start = std::chrono::steady_clock::now();
+        if (!renderer.render(re, im, scale, path)) {
+            std::cerr << "mandelbrot --render: can't write " << path << "\n";
+            return 1;
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << path << ": " << width << "x" << height << ", pixel size " << scale << ", " << elapsed.count()
+                  << " s\n";
+    }
+    return 0;
+}
+
+// "--bench-interior": what the early-outs save. Renders the standard view at higher and
+// higher iteration limits on one thread, with the brute-force loop, with the early-outs
+// (scalar and SIMD), and with subdivision on top; reports the time and how many pixels
+// differ from the brute-force picture (none, except possibly with subdivision).
+int run_interior_benchmark() {
+    Framebuffer frame(WIDTH, HEIGHT);
+    std::vector<Tile> tiles = make_tiles(WIDTH, HEIGHT, TILE_SIZE);
+    TilePool pool(1);
+    const Kernel brute_force = {"brute force", kernel_brute_force, 1};
+    const Kernel scalar = compiled_kernels().front();
+    std::cout << "Rendering " << WIDTH << "x" << HEIGHT << " on one thread\n";
+
+    bool exact = true;
+    for (int max_iterations : {100, 1000, 10000}) {
+        std::vector<int> reference;
+        double brute_ms = 0;
+        uint64_t brute_iterations = 0;
+        struct Run {
+            const char* name;
+            const Kernel* kernel;
+            bool subdivide;
+        };
+        for (const Run& run : {Run{"brute force", &brute_force, false}, Run{"scalar", &scalar, false},
+                               Run{active_kernel().name, &active_kernel(), false},
+                               Run{"+ subdivision", &active_kernel(), true}}) {
+            ColorTable colors(0, max_iterations);
+            FrameJob job = {&tiles, &frame, run.kernel, View()};
+            job.colors = &colors;
+            job.max_iterations = max_iterations;
+            job.subdivide = run.subdivide;
+            auto start = std::chrono::steady_clock::now();
+            render_job(pool, job);
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            int differing = 0;
+            if (reference.empty()) {
+                reference = frame.counts();
+                brute_ms = elapsed.count();
+                for (int count : reference) brute_iterations += count;
+                std::cout << "  " << max_iterations << " iterations (" << brute_iterations / 1e6
+                          << " million iterations by brute force)\n";
+            } else {
+                for (size_t i = 0; i < reference.size(); ++i) differing += frame.counts()[i] != reference[i];
+            }
+            if (!run.subdivide) exact = exact && differing == 0;
+            std::cout << "    " << run.name << ": " << elapsed.count() << " ms, speedup " << brute_ms / elapsed.count()
+                      << "x, " << differing << " pixels differ\n";
+        }
+    }
+    return exact ? 0 : 1;
+}
+
+// The original single-threaded loop, kept as the reference for the benchmark.
+void render_iterations_serial(std::vector<int>& counts) {
+    for (int x = 0; x < WIDTH; ++x) {
+        for (int y = 0; y < HEIGHT; ++y) {
+            counts[y * WIDTH + x] = mandelbrot(View().at(x, y));
+        }
+    }
+}
+
+// "--bench-threads": times the serial loop against the pool with 1, 4, 16 and 64
+// threads, and checks that every run produces exactly the same iteration counts.
+int run_thread_benchmark() {
+    const int repeats = 5; // We report the fastest of several runs, which is the least noisy.
+    std::vector<int> reference(WIDTH * HEIGHT);
+    Framebuffer frame(WIDTH, HEIGHT);
+    std::vector<Tile> tiles = make_tiles(WIDTH, HEIGHT, TILE_SIZE);
+
+    auto best_of = [&](const std::function<void()>& render) {
+        double best = 1e30;
+        for (int i = 0; i < repeats; ++i) {
+            auto start = std::chrono::steady_clock::now();
+            render();
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            best = std::min(best, elapsed.count());
+        }
+        return best;
+    };
+
+    double serial_ms = best_of([&] { render_iterations_serial(reference); });
+    std::cout << "Rendering " << WIDTH << "x" << HEIGHT << " at " << MAX_ITERATIONS << " iterations in "
+              << tiles.size() << " tiles of " << TILE_SIZE << "x" << TILE_SIZE << " ("
+              << std::thread::hardware_concurrency() << " hardware threads)\n";
+    std::cout << "  serial loop: " << serial_ms << " ms\n";
+
+    bool all_identical = true;
+    for (int threads : {1, 4, 16, 64}) {
+        TilePool pool(threads);
+        double ms = best_of([&] { render_frame(pool, tiles, frame); });
+        bool identical = frame.counts() == reference;
+        all_identical = all_identical && identical;
+        std::cout << "  " << threads << " threads: " << ms << " ms, speedup " << serial_ms / ms << "x"
+                  << (identical ? "" : "  (DIFFERENT RESULT!)") << "\n";
+    }
+    return all_identical ? 0 : 1;
+}
+
+// "--bench-kernels": times every kernel this CPU supports on one thread, and checks
+// that they all produce exactly the iteration counts of the scalar mandelbrot().
+int run_kernel_benchmark() {
+    const int repeats = 5;
+    std::vector<int> reference(WIDTH * HEIGHT);
+    Framebuffer frame(WIDTH, HEIGHT);
+    std::vector<Tile> tiles = make_tiles(WIDTH, HEIGHT, TILE_SIZE);
+    TilePool pool(1);
+    render_iterations_serial(reference);
+    std::cout << "Rendering " << WIDTH << "x" << HEIGHT << " at " << MAX_ITERATIONS
+              << " iterations on one thread (dispatch picks " << active_kernel().name << ")\n";
+
+    bool all_identical = true;
+    double scalar_ms = 0;
+    for (const Kernel& kernel : compiled_kernels()) {
+        if (!kernel_supported(kernel)) {
+            std::cout << "  " << kernel.name << ": not supported by this CPU\n";
+            continue;
+        }
+        double best = 1e30;
+        for (int i = 0; i < repeats; ++i) {
+            auto start = std::chrono::steady_clock::now();
+            render_frame(pool, tiles, frame, kernel);
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            best = std::min(best, elapsed.count());
+        }
+        if (scalar_ms == 0) scalar_ms = best;
+        bool identical = frame.counts() == reference;
+        all_identical = all_identical && identical;
+        std::cout << "  " << kernel.name << " (" << kernel.points_per_group << " points per group): " << best
+                  << " ms, speedup " << scalar_ms / best << "x" << (identical ? "" : "  (DIFFERENT RESULT!)") << "\n";
+    }
+    return all_identical ? 0 : 1;
+}
+
+// "--bench-json": the benchmark suite, for tracking performance from one version to
+// the next. Renders a fixed set of views at several iteration limits with every
+// variant: each SIMD kernel this CPU supports (the scalar one calls mandelbrot() for
+// every point) on one thread, the fastest one on all cores, and the GPU if there is
+// one. Prints the results as JSON on standard output (and progress on standard error),
+// so they can be saved and compared by a script:
+//    ./mandelbrot --bench-json > results.json
+//
+// Only rendering is timed, not creating the window, textures, threads or buffers. Every
+// CPU variant does the same work as in the window: iteration counts, smooth counts and
+// colors. The GPU times include reading the picture back, because that is the only
+// way SFML offers to wait until the GPU has finished. "iterations" counts a point inside
+// the set as max_iterations, whether it ran that many or stopped early, so Miters/s
+// measures how fast the picture is made rather than how much work was done.
+// Exits with 1 if a CPU variant's counts differ from the scalar kernel's.
+struct BenchmarkView {
+    const char* name;
+    double re, im; // The center,
+    double width;  // and how much of the real axis the picture shows.
+};
+
+const BenchmarkView BENCHMARK_VIEWS[] = {
+    {"full set", -0.5, 0.0, RE_END - RE_START},
+    {"seahorse valley", -0.7453, 0.1127, 0.01},
+    {"deep interior", -0.1226, 0.7449, 0.05}, // The period-3 bulb, which only the cycle check catches
+};
 
-            // Set the pixel color in the image
-            image.setPixel(x, y, color);
+int run_json_benchmark() {
+    const int repeats = 3;
+    const int threads = static_cast<int>(std::thread::hardware_concurrency());
+    Framebuffer frame(WIDTH, HEIGHT);
+    std::vector<Tile> tiles = make_tiles(WIDTH, HEIGHT, TILE_SIZE);
+    TilePool one_thread(1), all_threads(threads);
+    GpuRenderer gpu;
+    bool has_gpu = gpu.create(WIDTH, HEIGHT);
+
+    auto best_of = [&](const std::function<void()>& render) {
+        double best = 1e30;
+        for (int i = 0; i < repeats; ++i) {
+            auto start = std::chrono::steady_clock::now();
+            render();
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            best = std::min(best, elapsed.count());
+        }
+        return best;
+    };
+
+    std::cout << "{\n  \"width\": " << WIDTH << ",\n  \"height\": " << HEIGHT << ",\n  \"hardware_threads\": "
+              << threads << ",\n  \"dispatch\": \"" << active_kernel().name << "\",\n  \"repeats\": " << repeats
+              << ",\n  \"results\": [";
+    bool first = true, all_identical = true;
+    for (const BenchmarkView& bench_view : BENCHMARK_VIEWS) {
+        View view = centered_view(Fixed(bench_view.re), Fixed(bench_view.im), bench_view.width / WIDTH, WIDTH, HEIGHT);
+        for (int max_iterations : {100, 1000, 10000}) {
+            ColorTable colors(0, max_iterations);
+            std::vector<int> reference;
+            uint64_t iterations = 0;
+
+            // One line of JSON per variant: {"view": ..., "variant": ..., ...}.
+            auto report = [&](const std::string& variant, int used_threads, double ms, const char* identical) {
+                double pixels = static_cast<double>(WIDTH) * HEIGHT;
+                std::cout << (first ? "\n" : ",\n") << "    {\"view\": \"" << bench_view.name
+                          << "\", \"max_iterations\": " << max_iterations << ", \"variant\": \"" << variant
+                          << "\", \"threads\": " << used_threads << ", \"ms\": " << ms
+                          << ", \"ns_per_pixel\": " << ms * 1e6 / pixels
+                          << ", \"miters_per_s\": " << iterations / (ms * 1e3) << ", \"identical\": " << identical
+                          << "}";
+                first = false;
+                std::cerr << bench_view.name << ", " << max_iterations << " iterations, " << variant << ": " << ms
+                          << " ms\n";
+            };
+            auto run_cpu = [&](const std::string& variant, const Kernel& kernel, TilePool& pool, int used_threads) {
+                FrameJob job = {&tiles, &frame, &kernel, view};
+                job.colors = &colors;
+                job.max_iterations = max_iterations;
+                double ms = best_of([&] { render_job(pool, job); });
+                if (reference.empty()) {
+                    reference = frame.counts(); // The first variant is the scalar kernel
+                    for (int count : reference) iterations += count;
+                }
+                bool identical = frame.counts() == reference;
+                all_identical = all_identical && identical;
+                report(variant, used_threads, ms, identical ? "true" : "false");
+            };
+
+            for (const Kernel& kernel : compiled_kernels()) {
+                if (kernel_supported(kernel)) run_cpu(kernel.name, kernel, one_thread, 1);
+            }
+            run_cpu(std::string(active_kernel().name) + " threaded", active_kernel(), all_threads, threads);
+            if (has_gpu) {
+                double ms = best_of([&] {
+                    gpu.invalidate();
+                    gpu.render(view, max_iterations, 0);
+                    gpu.texture().copyToImage();
+                });
+                report("gpu", 0, ms, "null"); // There are no counts to compare
+            }
         }
     }
+    std::cout << "\n  ]\n}\n";
+    return all_identical ? 0 : 1;
+}
 
-    // Create an SFML Texture from the Image
+int main(int argc, char* argv[]) {
+    if (argc > 1 && std::string(argv[1]) == "--bench-threads") {
+        return run_thread_benchmark();
+    }
+    if (argc > 1 && std::string(argv[1]) == "--bench-kernels") {
+        return run_kernel_benchmark();
+    }
+    if (argc > 1 && std::string(argv[1]) == "--bench-interior") {
+        return run_interior_benchmark();
+    }
+    if (argc > 1 && std::string(argv[1]) == "--bench-json") {
+        return run_json_benchmark();
+    }
+    if (argc > 2 && std::string(argv[1]) == "--render") {
+        return run_batch(argc, argv);
+    }
+
+    // Create an SFML window
+    const std::string title = "Mandelbrot Set";
+    sf::RenderWindow window(sf::VideoMode(WIDTH, HEIGHT), title);
+
+    window.setFramerateLimit(60);
+
+    // Create an SFML Texture that the renderer uploads its frames to
     sf::Texture texture;
-    texture.loadFromImage(image);
+    texture.create(WIDTH, HEIGHT);
 
     // Create an SFML Sprite to display the Texture
     sf::Sprite sprite;
     sprite.setTexture(texture);
 
+    // Render in the background, using every CPU core
+    ProgressiveRenderer renderer(WIDTH, HEIGHT, static_cast<int>(std::thread::hardware_concurrency()));
+    View view;
+
+    // Or on the graphics card, if it can (and "--cpu" doesn't tell us not to)
+    GpuRenderer gpu;
+    bool use_gpu = !(argc > 1 && std::string(argv[1]) == "--cpu") && gpu.create(WIDTH, HEIGHT);
+    std::cout << (use_gpu ? "Rendering on the GPU (G switches to the CPU)\n" : "Rendering on the CPU\n");
+
+    bool dragging = false;
+    int drag_x = 0, drag_y = 0;
+    ProgressiveRenderer::Settings settings;
+
+    // Where the time of a frame goes, for the overlay F3 shows (see frame_profiler.hpp):
+    // "render" is the GPU's render, or handing the view to the CPU renderer and
+    // uploading its newest pass
+    enum Stage { Events, Render, Draw, Display };
+    Profiler profiler({"events", "render", "draw", "display"});
+    bool profiling = false;
+
     // Main application loop
     while (window.isOpen()) {
-        // Process events (like closing the window)
-        sf::Event event;
-        while (window.pollEvent(event)) {
-            if (event.type == sf::Event::Closed)
-                window.close();
+        // Process events: closing the window, and zooming and panning with the mouse
+        {
+            ScopedTimer timer(profiler[Events]);
+            sf::Event event;
+            while (window.pollEvent(event)) {
+                if (event.type == sf::Event::Closed) {
+                    window.close();
+                } else if (event.type == sf::Event::MouseWheelScrolled) {
+                    // Each notch of the wheel zooms by 1.25x, around the mouse pointer
+                    double factor = std::pow(0.8, event.mouseWheelScroll.delta);
+                    if (view.scale * factor < MIN_SCALE) continue; // As deep as we can go
+                    view = view.zoomed(factor, event.mouseWheelScroll.x, event.mouseWheelScroll.y);
+                } else if (event.type == sf::Event::MouseButtonPressed && event.mouseButton.button == sf::Mouse::Left) {
+                    dragging = true;
+                    drag_x = event.mouseButton.x;
+                    drag_y = event.mouseButton.y;
+                } else if (event.type == sf::Event::MouseButtonReleased && event.mouseButton.button == sf::Mouse::Left) {
+                    dragging = false;
+                } else if (event.type == sf::Event::MouseMoved && dragging) {
+                    // Move the picture along with the mouse
+                    view = view.panned(event.mouseMove.x - drag_x, event.mouseMove.y - drag_y);
+                    drag_x = event.mouseMove.x;
+                    drag_y = event.mouseMove.y;
+                } else if (event.type == sf::Event::KeyPressed && event.key.code == sf::Keyboard::R) {
+                    view = View(); // Back to the standard view
+                } else if (event.type == sf::Event::KeyPressed && event.key.code == sf::Keyboard::S) {
+                    settings.subdivide = !settings.subdivide; // Mariani-Silver subdivision on or off
+                } else if (event.type == sf::Event::KeyPressed && event.key.code == sf::Keyboard::Up) {
+                    settings.max_iterations *= 2; // Deep zooms need many more iterations
+                } else if (event.type == sf::Event::KeyPressed && event.key.code == sf::Keyboard::Down) {
+                    settings.max_iterations = std::max(MAX_ITERATIONS, settings.max_iterations / 2);
+                } else if (event.type == sf::Event::KeyPressed && event.key.code == sf::Keyboard::P) {
+                    settings.palette = (settings.palette + 1) % PALETTE_COUNT; // The next palette
+                } else if (event.type == sf::Event::KeyPressed && event.key.code == sf::Keyboard::G) {
+                    use_gpu = !use_gpu && gpu.can_render(View()); // GPU or CPU
+                } else if (event.type == sf::Event::KeyPressed && event.key.code == sf::Keyboard::F3) {
+                    profiling = !profiling;
+                    if (!profiling) window.setTitle(title); // Without the numbers
+                }
+            }
         }
 
-        // Clear the window
-        window.clear();
+        {
+            ScopedTimer timer(profiler[Render]);
+            if (use_gpu && gpu.can_render(view)) {
+                // The GPU draws the view in one go, straight into its own texture
+                gpu.render(view, settings.max_iterations, settings.palette);
+                sprite.setTexture(gpu.texture());
+            } else {
+                // The CPU renderer works in the background (and takes over deep views,
+                // which are beyond what doubles on the GPU can do). Show the newest pass
+                // it has finished, if there is one
+                renderer.configure(settings);
+                renderer.request(view);
+                renderer.upload(texture);
+                sprite.setTexture(texture);
+            }
+        }
+
+        {
+            ScopedTimer timer(profiler[Draw]);
+
+            // Clear the window
+            window.clear();
+
+            // Draw the sprite (which contains our Mandelbrot set visualization)
+            window.draw(sprite);
 
-        // Draw the sprite (which contains our Mandelbrot set visualization)
-        window.draw(sprite);
+            // And on top of it, where the time goes
+            if (profiling) profiler.draw(window, title);
+        }
+
+        {
+            ScopedTimer timer(profiler[Display]);
 
-        // Display the contents of the window
-        window.display();
+            // Display the contents of the window
+            window.display();
+        }
     }
 
     return 0; // Indicate successful execution
 }
 
 // Example Usage:
-// 1. Compile this code with an SFML setup. For example, using g++:
-//    g++ -o mandelbrot mandelbrot.cpp -lsfml-graphics -lsfml-window -lsfml-system
+// 1. Compile this code with an SFML setup, with frame_profiler.hpp (which it includes)
+//    in the same directory. For example, using g++:
+//    g++ -O2 -pthread -o mandelbrot mandelbrot.cpp -lsfml-graphics -lsfml-window -lsfml-system
 // 2. Run the executable:
 //    ./mandelbrot
 //
 // A window will open displaying the Mandelbrot fractal.
+// Turn the mouse wheel to zoom in and out around the pointer, drag with the left
+// mouse button to move around, and press R to return to the full view. Press S to
+// switch Mariani-Silver subdivision on or off: faster, but it may drop thin details.
+// You can zoom in to a pixel size of 1e-60: past 1e-12 the renderer switches to
+// perturbation, so keep zooming. The deeper you go, the more iterations the details
+// need: the Up and Down arrow keys double and halve the iteration limit.
+// Press P to switch to the next palette (classic, gradient, grey); the colors blend
+// smoothly between iteration counts, and the picture doesn't have to be recomputed.
+//
+// If your graphics card supports double precision shaders (OpenGL 4.0), the picture
+// is computed on the GPU, and the CPU takes over for deep views. Press G to switch
+// between the two, or start with "./mandelbrot --cpu" to leave the GPU out.
+// Press F3 to see where the time of each frame goes: a bar per stage, with its median
+// and its slowest 1% (the numbers are in the title bar).
 // You can experiment by changing RE_START, RE_END, IM_START, IM_END, and MAX_ITERATIONS
-// to zoom into different parts of the fractal or increase detail.
\ No newline at end of file
+// to start from a different part of the fractal or increase detail.
+//
+// Without a display (on a server, say), render straight to files instead. A poster,
+// written to disk strip by strip, so it needn't fit in memory:
+//    ./mandelbrot --render poster.png --size 40000x30000 --iterations 1000
+// and 300 frames zooming into the seahorse valley, each 0.97 times the size of the last:
+//    ./mandelbrot --render zoom####.png --size 1920x1080 --iterations 5000
+//        --view -0.7455 -0.7435 0.1125 0.1145 --frames 300 --zoom 0.97
+// (all on one line).
+// --view takes RE_START RE_END IM_START IM_END, and the picture is centered on it;
+// --palette takes classic, gradient or grey. Files not ending in .png get raw RGBA.
+//
+// To compare the single-threaded loop with the thread pool on your machine:
+//    ./mandelbrot --bench-threads
+// The fastest SIMD kernel your CPU supports is chosen automatically. To compare them
+// all, or to force one (here the plain C++ version):
+//    ./mandelbrot --bench-kernels
+//    MANDELBROT_KERNEL=scalar ./mandelbrot
+// To see how much the cardioid/bulb test and the cycle check save as the iteration
+// limit grows:
+//    ./mandelbrot --bench-interior
+// And all of it together, as JSON for comparing one version with the next: scalar,
+// SIMD, all cores and the GPU, on three views at 100, 1000 and 10000 iterations:
+//    ./mandelbrot --bench-json > results.json
+// Don't compile with -ffast-math: it allows the compiler to reorder the arithmetic,
+// and the kernels would no longer agree to the last iteration.
@@ -0,0 +1,148 @@
+// //////////////////////////////////////////////////////////////////////////////
+// // Frame profiler: where the time of a frame goes                           //
+// //////////////////////////////////////////////////////////////////////////////
+//
+// Shared by the SFML programs in this directory (the audio visualizer and the
+// Mandelbrot viewer); each of them includes this file and names its own stages.
+//
+// A stage is timed by a ScopedTimer: it reads the clock when it is created and again
+// when it goes out of scope, at the closing brace, so timing a stage takes a pair of
+// braces around it and a timer at the top. Each stage keeps the times of the last
+// PROFILE_FRAMES frames in a circular array; the percentiles come from a copy of it,
+// partially sorted with std::nth_element, and only while the overlay is shown.
+//
+// The overlay draws a bar for each stage, as long as the stage took in the median
+// frame (p50, green), and then on to how long it took in the slowest frame of every
+// hundred (p99, red). The white line is a whole frame at 60 frames per second. The
+// numbers themselves go in the title bar, which needs no font.
+//
+// Keep in mind that window.display() also waits for the frame rate limit (and with
+// vertical sync for the screen), so a stage around it is long when the rest is short:
+// it is the time left over in the frame.
+
+#ifndef FRAME_PROFILER_HPP
+#define FRAME_PROFILER_HPP
+
+#include <SFML/Graphics.hpp>
+#include <algorithm>        // For std::nth_element and std::min
+#include <chrono>           // For std::chrono::steady_clock, which times the stages
+#include <cstdio>           // For std::snprintf, which formats the numbers
+#include <initializer_list> // For the names of the stages
+#include <string>
+#include <vector>
+
+const std::size_t PROFILE_FRAMES = 300;          // The frames the percentiles cover (5 s)
+const float PROFILE_BUDGET_MS = 1000.0f / 60.0f; // A whole frame at 60 frames per second
+const float PROFILE_PIXELS_PER_MS = 12.0f;       // How long the bars are
+
+// The value that a fraction 'q' of 'values' are at most (0.5: the median). Reorders
+// 'values'.
+inline double percentile(std::vector<double>& values, double q) {
+    if (values.empty()) return 0.0;
+    std::size_t k = static_cast<std::size_t>(q * (values.size() - 1) + 0.5);
+    std::nth_element(values.begin(), values.begin() + k, values.end());
+    return values[k];
+}
+
+// The times of one stage in the last PROFILE_FRAMES frames, in milliseconds.
+class StageTimes {
+public:
+    explicit StageTimes(const char* name) : name_(name), times_(PROFILE_FRAMES) {}
+
+    const char* name() const { return name_; }
+
+    void add(double ms) {
+        times_[next_] = ms;
+        next_ = (next_ + 1) % PROFILE_FRAMES;
+        count_ = std::min(count_ + 1, PROFILE_FRAMES);
+    }
+
+    void percentiles(double& p50, double& p99) {
+        sorted_.assign(times_.begin(), times_.begin() + count_); // Until it's full, the first count_
+        p50 = percentile(sorted_, 0.50);
+        p99 = percentile(sorted_, 0.99);
+    }
+
+private:
+    const char* name_;
+    std::vector<double> times_;
+    std::vector<double> sorted_; // Kept, so the overlay allocates nothing
+    std::size_t next_ = 0, count_ = 0;
+};
+
+// Adds the time from its creation to the end of its scope to a stage.
+class ScopedTimer {
+public:
+    explicit ScopedTimer(StageTimes& stage) : stage_(stage), start_(std::chrono::steady_clock::now()) {}
+    ~ScopedTimer() {
+        stage_.add(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start_).count());
+    }
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+private:
+    StageTimes& stage_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+// The stages of a frame, in the order given, and the overlay that shows them. The
+// programs index them with an enum of their own.
+class Profiler {
+public:
+    Profiler(std::initializer_list<const char*> names) : bars_(sf::Quads) {
+        for (const char* name : names) stages_.emplace_back(name);
+    }
+
+    StageTimes& operator[](int stage) { return stages_[stage]; }
+
+    // Draws the overlay into the top left corner, and twice a second puts the numbers
+    // after 'title' in the title bar.
+    void draw(sf::RenderWindow& window, const std::string& title) {
+        const float left = 8.0f, row = 16.0f, longest = 2.0f * PROFILE_BUDGET_MS * PROFILE_PIXELS_PER_MS;
+        const float height = stages_.size() * row + left;
+        auto now = std::chrono::steady_clock::now();
+        bool retitle = now - titled_ >= std::chrono::milliseconds(500);
+        if (retitle) {
+            text_.assign(title); // Into the same string each time, so no allocation once it's long enough
+            text_ += "  (p50/p99 ms)";
+        }
+        bars_.clear();
+        rectangle(0.0f, 0.0f, longest + 2.0f * left, height, sf::Color(0, 0, 0, 160));
+        for (std::size_t s = 0; s < stages_.size(); ++s) {
+            double p50, p99;
+            stages_[s].percentiles(p50, p99);
+            float top = left + s * row;
+            float median = std::min(static_cast<float>(p50) * PROFILE_PIXELS_PER_MS, longest);
+            float slowest = std::min(static_cast<float>(p99) * PROFILE_PIXELS_PER_MS, longest);
+            rectangle(left, top, median, row - 4.0f, sf::Color::Green);
+            rectangle(left + median, top, slowest - median, row - 4.0f, sf::Color::Red);
+            if (retitle) {
+                char numbers[64];
+                std::snprintf(numbers, sizeof(numbers), "  %s %.2f/%.2f", stages_[s].name(), p50, p99);
+                text_ += numbers;
+            }
+        }
+        rectangle(left + PROFILE_BUDGET_MS * PROFILE_PIXELS_PER_MS, 0.0f, 1.0f, height, sf::Color::White);
+        window.draw(bars_);
+
+        if (retitle) {
+            window.setTitle(text_);
+            titled_ = now;
+        }
+    }
+
+private:
+    void rectangle(float x, float y, float width, float height, sf::Color color) {
+        bars_.append(sf::Vertex(sf::Vector2f(x, y), color));
+        bars_.append(sf::Vertex(sf::Vector2f(x + width, y), color));
+        bars_.append(sf::Vertex(sf::Vector2f(x + width, y + height), color));
+        bars_.append(sf::Vertex(sf::Vector2f(x, y + height), color));
+    }
+
+    std::vector<StageTimes> stages_;
+    sf::VertexArray bars_;
+    std::string text_;                             // The title with the numbers
+    std::chrono::steady_clock::time_point titled_; // When the title was last set
+};
+
+#endif // FRAME_PROFILER_HPP